@@ -1,9 +1,16 @@
 
 #include "ps3eye.h"
+#include "ps3eye_denoise.h"
+#include "ps3eye_correct.h"
+
+#include <cmath>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <atomic>
 
 #if defined WIN32 || defined _WIN32 || defined WINCE
 	#include <windows.h>
-	#include <algorithm>
 #else
 	#include <sys/time.h>
 	#include <time.h>
@@ -27,6 +34,10 @@ namespace ps3eye {
 #define OV534_OP_READ_2		0xf9
 
 #define CTRL_TIMEOUT 500
+#define PAYLOAD_SIZE 2048			/* bridge payload, set in the 0x1c/0x1d sequence */
+#define DEFAULT_TRANSFER_SIZE 16384
+#define TARGET_TRANSFER_RATE 500.0	/* completions per second in auto mode */
+#define RING_FRAMES 16				/* completed frame n sits in slot n % RING_FRAMES */
 #define VGA	 0
 #define QVGA 1
 
@@ -279,7 +290,7 @@ enum gspca_packet_type {
  */
 static uint8_t find_ep(struct libusb_device *device)
 {
-	const struct libusb_interface_descriptor *altsetting;
+	const struct libusb_interface_descriptor *altsetting = NULL;
     const struct libusb_endpoint_descriptor *ep;
 	struct libusb_config_descriptor *config;
     int i;
@@ -290,12 +301,17 @@ static uint8_t find_ep(struct libusb_device *device)
     if (!config) return 0;
 
     for (i = 0; i < config->bNumInterfaces; i++) {
-        altsetting = config->interface[i].altsetting;
-        if (altsetting[0].bInterfaceNumber == 0) {
+        if (config->interface[i].altsetting[0].bInterfaceNumber == 0) {
+            altsetting = config->interface[i].altsetting;
             break;
         }
     }
 
+    if (!altsetting) {
+        libusb_free_config_descriptor(config);
+        return 0;
+    }
+
     for (i = 0; i < altsetting->bNumEndpoints; i++) {
         ep = &altsetting->endpoint[i];
         if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_BULK 
@@ -312,15 +328,18 @@ static uint8_t find_ep(struct libusb_device *device)
 }
 
 // timestapms
-// WIN and MAC only
 static int64_t getTickCount()
 {
 #if defined WIN32 || defined _WIN32 || defined WINCE
     LARGE_INTEGER counter;
     QueryPerformanceCounter( &counter );
     return (int64_t)counter.QuadPart;
-#else
+#elif defined __MACH__ && defined __APPLE__
     return (int64_t)mach_absolute_time();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 #endif
 }
 
@@ -330,7 +349,7 @@ static double getTickFrequency()
     LARGE_INTEGER freq;
     QueryPerformanceFrequency(&freq);
     return (double)freq.QuadPart;
-#else
+#elif defined __MACH__ && defined __APPLE__
     static double freq = 0;
     if( freq == 0 )
     {
@@ -339,6 +358,26 @@ static double getTickFrequency()
         freq = sTimebaseInfo.denom*1e9/sTimebaseInfo.numer;
     }
     return freq;
+#else
+    return 1e9;
+#endif
+}
+
+// CPU seconds used by the calling thread, user and kernel time
+static double getThreadCPUTime()
+{
+#if defined WIN32 || defined _WIN32 || defined WINCE
+    FILETIME creation, exit, kernel, user;
+    if( !GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user) )
+        return 0;
+    return (((uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+            ((uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime)) * 1e-7;
+#elif defined CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    return getTickCount() / getTickFrequency();
 #endif
 }
 //
@@ -347,6 +386,17 @@ static double getTickFrequency()
 const uint16_t PS3EYECam::VENDOR_ID = 0x1415;
 const uint16_t PS3EYECam::PRODUCT_ID = 0x2000;
 
+// hotplug arrived in libusbx 1.0.16, before LIBUSB_API_VERSION existed;
+// the bundled header is older, so it needs PS3EYE_SYSTEM_LIBUSB
+#if defined(LIBUSB_API_VERSION)
+	#define PS3EYE_LIBUSB_API LIBUSB_API_VERSION
+#elif defined(LIBUSBX_API_VERSION)
+	#define PS3EYE_LIBUSB_API LIBUSBX_API_VERSION
+#else
+	#define PS3EYE_LIBUSB_API 0
+#endif
+#define PS3EYE_HAS_HOTPLUG (PS3EYE_LIBUSB_API >= 0x01000102)
+
 class USBMgr
 {
  public:
@@ -357,12 +407,20 @@ class USBMgr
     static libusb_context* usbContext() { return instance()->usb_context; }
     static int listDevices(std::vector<PS3EYECam::PS3EYERef>& list);
     static bool handleEvents();
+    static bool hasHotplug() { return instance()->hotplug; }
+    static std::string portPath(libusb_device *dev);
 
     static std::shared_ptr<USBMgr>  sInstance;
     static int                      sTotalDevices;
+    static double                   sEventCPUTime;
 
  private:   
     libusb_context* usb_context;
+    bool hotplug;
+#if PS3EYE_HAS_HOTPLUG
+    libusb_hotplug_callback_handle hotplug_handle;
+    static int LIBUSB_CALL cb_hotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data);
+#endif
 
     USBMgr(const USBMgr&);
     void operator=(const USBMgr&);
@@ -370,21 +428,60 @@ class USBMgr
 
 std::shared_ptr<USBMgr> USBMgr::sInstance;
 int                     USBMgr::sTotalDevices = 0;
+double                  USBMgr::sEventCPUTime = 0;
+
+#if PS3EYE_HAS_HOTPLUG
+int LIBUSB_CALL USBMgr::cb_hotplug(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+    (void)ctx;
+    (void)user_data;
+    if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+        PS3EYECam::device_arrived(dev);
+    else
+        PS3EYECam::device_left(dev);
+    return 0;
+}
+#endif
 
 USBMgr::USBMgr()
 {
     libusb_init(&usb_context);
+#if PS3EYE_LIBUSB_API >= 0x01000106
+    libusb_set_option(usb_context, LIBUSB_OPTION_LOG_LEVEL, 1);
+#else
     libusb_set_debug(usb_context, 1);
+#endif
+
+    hotplug = false;
+#if PS3EYE_HAS_HOTPLUG
+    if(libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+    {
+        int res = libusb_hotplug_register_callback(usb_context,
+                        (libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+                        (libusb_hotplug_flag)0, PS3EYECam::VENDOR_ID, PS3EYECam::PRODUCT_ID,
+                        LIBUSB_HOTPLUG_MATCH_ANY, cb_hotplug, NULL, &hotplug_handle);
+        hotplug = (res == LIBUSB_SUCCESS);
+    }
+#endif
+    debug("hotplug %s\n", hotplug ? "enabled" : "not available");
 }
 
 USBMgr::~USBMgr()
 {
     debug("USBMgr destructor\n");
+#if PS3EYE_HAS_HOTPLUG
+    if(hotplug)
+        libusb_hotplug_deregister_callback(usb_context, hotplug_handle);
+#endif
     libusb_exit(usb_context);
 }
 
+// first use can come from the app or the updateDevices thread
+static std::mutex instance_lock;
+
 std::shared_ptr<USBMgr> USBMgr::instance()
 {
+    std::lock_guard<std::mutex> lock(instance_lock);
     if( !sInstance ) {
         sInstance = std::shared_ptr<USBMgr>( new USBMgr );
     }
@@ -396,14 +493,41 @@ bool USBMgr::handleEvents()
 	struct timeval tv;
 	tv.tv_sec = 0;
 	tv.tv_usec = 50 * 1000; // ms
-	return (libusb_handle_events_timeout_completed(instance()->usb_context, &tv, NULL) == 0);
+	double cpu = getThreadCPUTime();
+	bool res = (libusb_handle_events_timeout_completed(instance()->usb_context, &tv, NULL) == 0);
+	sEventCPUTime += getThreadCPUTime() - cpu;
+	return res;
 }
 
+// "bus-port.port..." as in Linux sysfs, stable for a given socket
+std::string USBMgr::portPath(libusb_device *dev)
+{
+    uint8_t ports[8];
+    char buf[64];
+    int i, n, len;
+
+#if PS3EYE_LIBUSB_API >= 0x01000102
+    n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+#else
+    n = libusb_get_port_path(instance()->usb_context, dev, ports, sizeof(ports));
+#endif
+    len = snprintf(buf, sizeof(buf), "%d", libusb_get_bus_number(dev));
+    for(i = 0; i < n && len < (int)sizeof(buf); i++)
+    {
+        len += snprintf(buf + len, sizeof(buf) - len, i ? ".%d" : "-%d", ports[i]);
+    }
+    return std::string(buf);
+}
+
+/* Scan the bus and merge the result into list: cameras already in the
+ * list stay (same instance), new ones are appended and those no longer
+ * present are removed. Returns the number of cameras found. */
 int USBMgr::listDevices( std::vector<PS3EYECam::PS3EYERef>& list )
 {
     libusb_device *dev;
     libusb_device **devs;
-    libusb_device_handle *devhandle;
+    std::vector<libusb_device*> found;
+    size_t j;
     int i = 0;
     int cnt;
 
@@ -411,53 +535,85 @@ int USBMgr::listDevices( std::vector<PS3EYECam::PS3EYERef>& list )
 
 	if (cnt < 0) {
 		debug("Error Device scan\n");
+		return 0;
 	}
 
-    cnt = 0;
     while ((dev = devs[i++]) != NULL) 
     {
     	struct libusb_device_descriptor desc;
 		libusb_get_device_descriptor(dev, &desc);
 		if(desc.idVendor == PS3EYECam::VENDOR_ID && desc.idProduct == PS3EYECam::PRODUCT_ID)
 		{
-            int err = libusb_open(dev, &devhandle);
-            if (err == 0)
-            {
-                libusb_close(devhandle);
-                list.push_back( PS3EYECam::PS3EYERef( new PS3EYECam(dev) ) );
-                libusb_ref_device(dev);
-                cnt++;
-
-            }
+            found.push_back(dev);
+            PS3EYECam::device_arrived(dev);
 		}
     }
 
+    for(j = list.size(); j-- > 0; )
+    {
+        if(std::find(found.begin(), found.end(), list[j]->device_) == found.end())
+            PS3EYECam::device_left(list[j]->device_);
+    }
+
     libusb_free_device_list(devs, 1);
 
-    return cnt;
+    return (int)found.size();
 }
 
 // URBDesc
 
 static void LIBUSB_CALL cb_xfr(struct libusb_transfer *xfr);
 
+#define SETTINGS_QUEUE	16
+
 class URBDesc
 {
 public:
 	URBDesc() : num_transfers(0), last_packet_type(DISCARD_PACKET), last_pts(0), last_fid(0)
 	{
-		// we allocate max possible size
-		// 16 frames 
-		size_t stride = 640*2;
-		const size_t fsz = stride*480;
-		frame_buffer = (uint8_t*)malloc(fsz * 16 + 16384*2);
-		frame_buffer_end = frame_buffer + fsz * 16;
+		xfr[0] = xfr[1] = NULL;
+		stream_error = false;
+		device_gone = false;
+		bracket_changed = false;
+		delay_lines = 0;
+		delay_busy = false;
+		// the ring is sized by start_transfers for the current mode
+		frame_buffer = NULL;
+		frame_buffer_end = NULL;
+		frame_buffer_size = 0;
+		xfr_buffer = NULL;
+		xfr_buffer_size = 0;
+		xfr_handle = NULL;
+		xfr_dev_mem = false;
+		memset(&stats, 0, sizeof(stats));
+		start_time = 0;
 
         frame_data_start = frame_buffer;
         frame_data_len = 0;
 		frame_complete_ind = 0;
 		frame_work_ind = 0;
-        frame_size = fsz;
+        frame_size = 0;
+        frame_stride = 0;
+		frame_rows = 0;
+		slice_rows = 0;
+		slice_done = 0;
+		slice_cb = NULL;
+		slice_user = NULL;
+		denoise_on = false;
+		denoise_done = 0;
+		denoise_next.strength = 0;
+		denoise_next.low = 6;
+		denoise_next.high = 24;
+		denoise_changed = false;
+		correct_done = 0;
+		memset(&frame_settings, 0, sizeof(frame_settings));
+		frame_settings.bracket = -1;
+		settings_head = settings_tail = 0;
+		frame_format = FORMAT_YUYV;
+		frame_seq = 0;
+		frame_pts = 0;
+		memset(frame_meta, 0, sizeof(frame_meta));
+		last_frame_time = 0;
 	}
 	~URBDesc()
 	{
@@ -466,56 +622,166 @@ public:
 		{
 			close_transfers();
 		}
+		free_transfer_buffers();
         if(frame_buffer != NULL)
             free(frame_buffer);
         frame_buffer = NULL;
 	}
 
-	bool start_transfers(libusb_device_handle *handle, uint32_t curr_frame_size)
+	// RING_FRAMES frames of the current mode
+	bool alloc_ring(uint32_t curr_frame_size)
+	{
+		size_t fsz = curr_frame_size * RING_FRAMES;
+		if(frame_buffer != NULL && frame_buffer_size == fsz)
+			return true;
+
+		if(frame_buffer != NULL)
+			free(frame_buffer);
+		frame_buffer = (uint8_t*)malloc(fsz);
+		if(frame_buffer == NULL)
+		{
+			frame_buffer_size = 0;
+			return false;
+		}
+		frame_buffer_end = frame_buffer + fsz;
+		frame_buffer_size = fsz;
+		return true;
+	}
+
+	// Bulk transfer buffers. Where libusb and the OS support it (usbfs on
+	// Linux) they are mapped from the kernel so completed transfers are
+	// not copied to user space; otherwise they come from the heap.
+	bool alloc_transfer_buffers(libusb_device_handle *handle, size_t size)
+	{
+		if(xfr_buffer != NULL && xfr_buffer_size == size && xfr_handle == handle)
+			return true;
+		free_transfer_buffers();
+
+#if PS3EYE_LIBUSB_API >= 0x01000105
+		// NULL where the backend has no support, then the heap is used
+		xfr_buffer = libusb_dev_mem_alloc(handle, size);
+		xfr_dev_mem = (xfr_buffer != NULL);
+#endif
+		if(xfr_buffer == NULL)
+		{
+			xfr_buffer = (uint8_t*)malloc(size);
+			xfr_dev_mem = false;
+		}
+		if(xfr_buffer == NULL)
+			return false;
+
+		debug("transfer buffers: %d bytes of %s memory\n", (int)size, xfr_dev_mem ? "device" : "heap");
+		xfr_buffer_size = size;
+		xfr_handle = handle;
+		return true;
+	}
+
+	// must run before the device handle is closed
+	void free_transfer_buffers()
+	{
+		if(xfr_buffer == NULL)
+			return;
+#if PS3EYE_LIBUSB_API >= 0x01000105
+		if(xfr_dev_mem)
+			libusb_dev_mem_free(xfr_handle, xfr_buffer, xfr_buffer_size);
+		else
+#endif
+			free(xfr_buffer);
+		xfr_buffer = NULL;
+		xfr_buffer_size = 0;
+		xfr_handle = NULL;
+		xfr_dev_mem = false;
+	}
+
+	bool start_transfers(libusb_device_handle *handle, uint32_t curr_frame_size, uint32_t curr_stride,
+						 FrameFormat curr_format, int bsize)
 	{
-		struct libusb_transfer *xfr0,*xfr1;
-		uint8_t* buff, *buff1;
-		uint8_t ep_addr;
-	    int bsize = 16384;
-        
         frame_size = curr_frame_size;
+        frame_stride = curr_stride;
+        frame_format = curr_format;
+        if(!alloc_ring(frame_size) || !alloc_transfer_buffers(handle, bsize*2))
+        {
+            debug("frame ring allocation failed\n");
+            return false;
+        }
 
-	    // bulk transfers
-	    xfr0 = libusb_alloc_transfer(0);
-	    xfr1 = libusb_alloc_transfer(0);
+	    frame_complete_ind = 0;
+		frame_work_ind = 0;
+		frame_rows = 0;
+		slice_done = 0;
+		denoise_done = 0;
+		denoise.reset();
+		correct_done = 0;
+		frame_correction.reset();
+		last_frame_time = 0;
+		frame_seq = 0;
+		frame_pts = 0;
+		memset(frame_meta, 0, sizeof(frame_meta));
+		clock.reset();
+		memset(&stats, 0, sizeof(stats));
+		stats.device_memory = xfr_dev_mem;
+		stats.transfer_size = bsize;
+		start_time = (double)getTickCount();
+
+		return submit_transfers(handle, bsize);
+	}
 
-	    buff = frame_buffer_end;
-	    buff1 = buff + bsize;
-        memset(frame_buffer_end, 0, bsize*2);
+	// (re)submit both bulk transfers, keeps the ring and counters
+	bool submit_transfers(libusb_device_handle *handle, int bsize)
+	{
+		uint8_t ep_addr;
+		int i, res = 0;
 
-	    xfr[0] = xfr0;
-	    xfr[1] = xfr1;
+		stream_error = false;
+		last_packet_type = DISCARD_PACKET;
+		last_pts = 0;
+		last_fid = 0;
 
 	    ep_addr = find_ep(libusb_get_device(handle));
 	    //debug("found ep: %d\n", ep_addr);
 
 	    libusb_clear_halt(handle, ep_addr);
 
-	    libusb_fill_bulk_transfer(xfr0, handle, ep_addr, buff, bsize, cb_xfr, reinterpret_cast<void*>(this), 0);
-	    libusb_fill_bulk_transfer(xfr1, handle, ep_addr, buff1, bsize, cb_xfr, reinterpret_cast<void*>(this), 0);
+	    // bulk transfers
+	    for(i = 0; i < 2; i++)
+	    {
+	    	xfr[i] = libusb_alloc_transfer(0);
+	    	libusb_fill_bulk_transfer(xfr[i], handle, ep_addr, xfr_buffer + i*bsize, bsize, cb_xfr, reinterpret_cast<void*>(this), 0);
+	    	int err = libusb_submit_transfer(xfr[i]);
+	    	if(err == 0)
+	    	{
+	    		num_transfers++;
+	    	} else {
+	    		debug("error submitting URB %d\n", i);
+	    		if(err == LIBUSB_ERROR_NO_DEVICE) device_gone = true;
+	    		libusb_free_transfer(xfr[i]);
+	    		xfr[i] = NULL;
+	    		res = -1;
+	    	}
+	    }
 
-	    int res = libusb_submit_transfer(xfr0);
-	    res |= libusb_submit_transfer(xfr1);
+		return res == 0;
+	}
 
-	    num_transfers = 2;
-	    frame_complete_ind = 0;
-		frame_work_ind = 0;
-		last_pts = 0;
-		last_fid = 0;
-		last_frame_time = 0;
+	// called from the transfer callback once a transfer is freed
+	void release_transfer(libusb_transfer *t)
+	{
+		for(int i = 0; i < 2; i++)
+			if(xfr[i] == t) xfr[i] = NULL;
+		libusb_free_transfer(t);
+		num_transfers--;
+	}
 
-		return res == 0;
+	// cancel what is still in flight without waiting, safe inside callbacks
+	void cancel_transfers()
+	{
+		for(int i = 0; i < 2; i++)
+			if(xfr[i] != NULL) libusb_cancel_transfer(xfr[i]);
 	}
 
 	void close_transfers()
 	{
-		libusb_cancel_transfer(xfr[0]);
-	    libusb_cancel_transfer(xfr[1]);
+		cancel_transfers();
 	    while(num_transfers)
 	    {
 	    	if( !USBMgr::instance()->handleEvents() )
@@ -532,6 +798,30 @@ public:
 	    {
 	        frame_data_start = frame_buffer + frame_work_ind*frame_size;
             frame_data_len = 0;
+            frame_rows = 0;
+            slice_done = 0;
+            denoise_done = 0;
+            correct_done = 0;
+            {
+                // one calibration for the whole frame
+                std::lock_guard<std::mutex> lock(correction_lock);
+                frame_correction = correction;
+                if(frame_correction && (frame_correction->getWidth() * (frame_format == FORMAT_YUYV ? 2 : 1) != frame_stride ||
+                                        frame_correction->getHeight() != frame_size / frame_stride))
+                    frame_correction.reset();
+            }
+            {
+                // filter settings of setDenoise() from this frame on
+                std::lock_guard<std::mutex> lock(denoise_lock);
+                if(denoise_changed)
+                {
+                    denoise.setMotionThresholds(denoise_next.low, denoise_next.high);
+                    denoise.setStrength(denoise_next.strength);
+                    if(!denoise_on) denoise.reset();
+                    denoise_on = denoise_next.strength > 0;
+                    denoise_changed = false;
+                }
+            }
 	    } 
 	    else
 	    {
@@ -560,21 +850,123 @@ public:
             } else {
                 memcpy(frame_data_start+frame_data_len, data, len);
                 frame_data_len += len;
+                frame_rows = frame_data_len / frame_stride;
+                if(frame_correction) correct_add();
+                if(denoise_on) denoise_add();
+                if(slice_cb) slice_add();
             }
 	    }
 
 	    last_packet_type = packet_type;
+	    if (packet_type == DISCARD_PACKET)
+	    {
+	        frame_rows = 0;
+	        denoise_done = 0;
+	        correct_done = 0;
+	    }
 
 	    if (packet_type == LAST_PACKET) {        
 	    	last_frame_time = (double)getTickCount();
+	    	FrameInfo &info = frame_meta[frame_work_ind];
+	    	info.sequence = frame_seq++;
+	    	info.pts = frame_pts;
+	    	info.timestamp = last_frame_time / getTickFrequency();
+	    	info.device_time = clock.update(frame_pts, info.timestamp);
+	    	info.format = frame_format;
+	    	settings_for(info);
+	    	stats.frames++;
 	        frame_complete_ind = frame_work_ind;
-	        i = (frame_work_ind + 1) & 15;
+	        i = (frame_work_ind + 1) % RING_FRAMES;
 	        frame_work_ind = i;            
             frame_data_len = 0;
+            frame_rows = 0;
+            denoise_done = 0;
+            correct_done = 0;
 	        //debug("frame completed %d\n", frame_complete_ind);
 	    }
 	}
 
+	// Sensor settings by frame. A control write is queued with the frame
+	// count when it completed and the first sequence it applies to;
+	// completed frames take the newest change that has started. Filled
+	// from the app thread and updateDevices().
+	void reset_settings(const CaptureSettings &settings)
+	{
+		std::lock_guard<std::mutex> lock(settings_lock);
+		settings_head = settings_tail = 0;
+		frame_settings.settings = settings;
+		frame_settings.bracket = -1;
+		frame_settings.written = 0;
+		frame_settings.from = 0;
+	}
+
+	void push_settings(const CaptureSettings &settings, int16_t bracket, uint32_t written, uint32_t from)
+	{
+		std::lock_guard<std::mutex> lock(settings_lock);
+		if(settings_tail - settings_head == SETTINGS_QUEUE)
+		{
+			// out of room, the oldest change is as good as started
+			frame_settings = settings_queue[settings_head++ % SETTINGS_QUEUE];
+		}
+		SettingsChange &c = settings_queue[settings_tail++ % SETTINGS_QUEUE];
+		c.settings = settings;
+		c.bracket = bracket;
+		c.written = written;
+		c.from = from;
+	}
+
+	void settings_for(FrameInfo &info)
+	{
+		std::lock_guard<std::mutex> lock(settings_lock);
+		while(settings_head != settings_tail)
+		{
+			const SettingsChange &c = settings_queue[settings_head % SETTINGS_QUEUE];
+			if((int32_t)(info.sequence - c.from) < 0)
+				break;
+			frame_settings = c;
+			settings_head++;
+		}
+		info.settings = frame_settings.settings;
+		info.settings_sequence = frame_settings.written;
+		info.bracket = frame_settings.bracket;
+		// a later write already done while this frame was received
+		info.settings_pending = settings_head != settings_tail &&
+			(int32_t)(info.sequence - settings_queue[settings_head % SETTINGS_QUEUE].written) >= 0;
+	}
+
+	// correct the new complete rows in place, ahead of the noise filter
+	void correct_add()
+	{
+		if(frame_rows <= correct_done)
+			return;
+		frame_correction->apply(frame_data_start, frame_stride,
+								pixelInput(frame_format),
+								correct_done, frame_rows);
+		correct_done = frame_rows;
+	}
+
+	// filter the new complete rows in place, ahead of slices and readers
+	void denoise_add()
+	{
+		if(frame_rows <= denoise_done)
+			return;
+		denoise.apply(frame_data_start, frame_stride, frame_stride, frame_size / frame_stride,
+					  denoise_done, frame_rows);
+		denoise_done = frame_rows;
+	}
+
+	// report the rows received since the last slice, every slice_rows
+	void slice_add()
+	{
+		uint32_t rows = frame_rows;
+		if(frame_data_len != frame_size)
+			rows -= rows % slice_rows;
+		if(rows <= slice_done)
+			return;
+		slice_cb(slice_user, frame_data_start, frame_seq, slice_done, rows);
+		slice_done = rows;
+	}
+
 	void pkt_scan(uint8_t *data, int len)
 	{
 	    uint32_t this_pts;
@@ -582,7 +974,7 @@ public:
 	    int remaining_len = len;
 	    int payload_len;
 
-	    payload_len = 2048; // bulk type
+	    payload_len = PAYLOAD_SIZE; // bulk type
 	    do {
 			len = (std::min)(remaining_len, payload_len);
 
@@ -620,6 +1012,7 @@ public:
 	            }
 	            last_pts = this_pts;
 	            last_fid = this_fid;
+	            frame_pts = this_pts;
 	            frame_add(FIRST_PACKET, data + 12, len - 12);
 	        } /* If this packet is marked as EOF, end the frame */
 	        else if (data[1] & UVC_STREAM_EOF) 
@@ -649,18 +1042,73 @@ public:
 	}
 
 	uint8_t num_transfers;
+	bool stream_error;
+	bool device_gone;	// a transfer found the device unplugged
 	enum gspca_packet_type last_packet_type;
 	uint32_t last_pts;
 	uint16_t last_fid;
 	libusb_transfer *xfr[2];
 
+	uint8_t *xfr_buffer;
+	size_t xfr_buffer_size;
+	libusb_device_handle *xfr_handle;
+	bool xfr_dev_mem;
+	TransferStats stats;
+	double start_time;
+
 	uint8_t *frame_buffer;
     uint8_t *frame_buffer_end;
+	size_t frame_buffer_size;
     uint8_t *frame_data_start;
 	uint32_t frame_data_len;
 	uint32_t frame_size;
+	uint32_t frame_stride;
+	uint32_t frame_rows;		// complete rows of the frame being received
+	uint32_t slice_rows;
+	uint32_t slice_done;		// rows already passed to slice_cb
+	PS3EYECam::SliceCallback slice_cb;
+	void *slice_user;
+	TemporalDenoise denoise;
+	bool denoise_on;
+	uint32_t denoise_done;		// rows of the frame being received already filtered
+	struct DenoiseSettings
+	{
+		float strength;
+		uint8_t low, high;
+	};
+	DenoiseSettings denoise_next;	// from setDenoise(), taken at the next frame start
+	bool denoise_changed;
+	std::mutex denoise_lock;
+	std::shared_ptr<const FrameCorrection> correction;
+	std::shared_ptr<const FrameCorrection> frame_correction;	// of the frame being received
+	uint32_t correct_done;
+	std::mutex correction_lock;
+	struct SettingsChange
+	{
+		CaptureSettings settings;
+		int16_t bracket;
+		uint32_t written;		// frame count when the write completed
+		uint32_t from;			// first sequence taken with it
+	};
+	SettingsChange settings_queue[SETTINGS_QUEUE];
+	uint32_t settings_head, settings_tail;
+	SettingsChange frame_settings;	// of the frames being received now
+	std::mutex settings_lock;
+	std::vector<BracketStep> bracket_next;	// from setBracketing(), for write_bracket()
+	bool bracket_changed;
+	std::mutex bracket_lock;
+	// register I/O of the camera, from the app and the updateDevices()
+	// thread; held across whole SCCB transactions and sequences
+	std::recursive_mutex reg_lock;
+	std::atomic<uint32_t> delay_lines;	// from delayFrame(), until check_delay() writes them
+	std::atomic<bool> delay_busy;		// from delayFrame() until the timing is restored
 	uint8_t frame_complete_ind;
 	uint8_t frame_work_ind;
+	FrameFormat frame_format;
+	uint32_t frame_seq;
+	uint32_t frame_pts;
+	FrameInfo frame_meta[RING_FRAMES];
+	ClockModel clock;
 
 	double last_frame_time;
 };
@@ -674,23 +1122,32 @@ static void LIBUSB_CALL cb_xfr(struct libusb_transfer *xfr)
     {
         debug("transfer status %d\n", status);
 
-        libusb_free_transfer(xfr);
-        urb->num_transfers--;
+        urb->release_transfer(xfr);
         
         if(status != LIBUSB_TRANSFER_CANCELLED)
         {
-            urb->close_transfers();
+            // the stream is broken, the watchdog picks it up from here
+            urb->stream_error = true;
+            if(status == LIBUSB_TRANSFER_NO_DEVICE) urb->device_gone = true;
+            urb->cancel_transfers();
         }
         return;
     }
 
     //debug("length:%u, actual_length:%u\n", xfr->length, xfr->actual_length);
 
+    int64_t t0 = getTickCount();
     urb->pkt_scan(xfr->buffer, xfr->actual_length);
+    urb->stats.transfers++;
+    urb->stats.callback_time += (getTickCount() - t0) / getTickFrequency();
 
-    if (libusb_submit_transfer(xfr) < 0) {
+    int res = libusb_submit_transfer(xfr);
+    if (res < 0) {
         debug("error re-submitting URB\n");
-        urb->close_transfers();
+        if(res == LIBUSB_ERROR_NO_DEVICE) urb->device_gone = true;
+        urb->release_transfer(xfr);
+        urb->stream_error = true;
+        urb->cancel_transfers();
     }
 }
 
@@ -698,23 +1155,158 @@ static void LIBUSB_CALL cb_xfr(struct libusb_transfer *xfr)
 
 bool PS3EYECam::devicesEnumerated = false;
 std::vector<PS3EYECam::PS3EYERef> PS3EYECam::devices;
+// devices is read by the app and changed by hotplug events on the
+// updateDevices() thread. Cameras that left are parked until the event
+// handling returns, so the last reference is not dropped inside it.
+static std::mutex devices_lock;
+static std::vector<PS3EYECam::PS3EYERef> departed_devices;
 
-const std::vector<PS3EYECam::PS3EYERef>& PS3EYECam::getDevices( bool forceRefresh )
-{
-    if( devicesEnumerated && ( ! forceRefresh ) )
-        return devices;
+PS3EYECam::HotplugCallback PS3EYECam::hotplugCallback = NULL;
+void* PS3EYECam::hotplugUserData = NULL;
 
-    devices.clear();
+std::vector<PS3EYECam::PS3EYERef> PS3EYECam::getDevices( bool forceRefresh )
+{
+    std::vector<PS3EYERef> list, departed;
+    bool hotplug = USBMgr::hasHotplug();
+    {
+        std::lock_guard<std::mutex> lock(devices_lock);
+        list = devices;
+        // with hotplug events the list is kept current by updateDevices()
+        if( devicesEnumerated && ( ! forceRefresh || hotplug ) )
+            return list;
+    }
 
-    USBMgr::instance()->sTotalDevices = USBMgr::instance()->listDevices(devices);
+    int found = USBMgr::instance()->listDevices(list);
 
+    std::lock_guard<std::mutex> lock(devices_lock);
+    USBMgr::sTotalDevices = found;
     devicesEnumerated = true;
+    departed.swap(departed_devices);
     return devices;
 }
 
 bool PS3EYECam::updateDevices()
 {
-	return USBMgr::instance()->handleEvents();
+	bool res = USBMgr::instance()->handleEvents();
+
+	// hotplug events may change the list while streams recover
+	std::vector<PS3EYERef> list, departed;
+	{
+		std::lock_guard<std::mutex> lock(devices_lock);
+		list = devices;
+		departed.swap(departed_devices);
+	}
+	for(size_t i = 0; i < list.size(); i++)
+	{
+		list[i]->check_stream();
+	}
+	// cameras that left are released here, outside the event handling
+	return res;
+}
+
+PS3EYECam::PS3EYERef PS3EYECam::getDeviceByPortPath( const std::string& portPath )
+{
+	std::vector<PS3EYERef> list = getDevices(true);
+	for(size_t i = 0; i < list.size(); i++)
+	{
+		if(list[i]->port_path == portPath) return list[i];
+	}
+	return PS3EYERef();
+}
+
+bool PS3EYECam::getController(USBController &controller) const
+{
+	libusb_device **devs;
+	libusb_device *dev, *parent;
+	struct libusb_device_descriptor desc;
+
+	// parents are only valid while a device list is held
+	if(libusb_get_device_list(USBMgr::usbContext(), &devs) < 0)
+	{
+		debug("Error Device scan\n");
+		return false;
+	}
+
+	dev = device_;
+	while((parent = libusb_get_parent(dev)) != NULL) dev = parent;
+
+	// backends without topology information stop at the camera itself
+	bool res = (dev != device_ && libusb_get_device_descriptor(dev, &desc) == 0);
+	if(res)
+	{
+		controller.bus = libusb_get_bus_number(dev);
+		controller.vendor = desc.idVendor;
+		controller.product = desc.idProduct;
+		controller.speed = libusb_get_device_speed(dev);
+	}
+	libusb_free_device_list(devs, 1);
+	return res;
+}
+
+void PS3EYECam::setHotplugCallback(HotplugCallback callback, void *userData)
+{
+	hotplugCallback = callback;
+	hotplugUserData = userData;
+}
+
+void PS3EYECam::device_arrived(libusb_device *dev)
+{
+	std::string path = USBMgr::portPath(dev);
+	PS3EYERef cam, replaced;
+	{
+		std::lock_guard<std::mutex> lock(devices_lock);
+		for(size_t i = 0; i < devices.size(); i++)
+		{
+			if(devices[i]->device_ == dev) return;
+			if(devices[i]->port_path == path)
+			{
+				// replugged into the same socket before we saw it leave
+				replaced = devices[i];
+				devices.erase(devices.begin() + i);
+				break;
+			}
+		}
+
+		libusb_ref_device(dev);
+		cam = PS3EYERef( new PS3EYECam(dev) );
+		devices.push_back(cam);
+		USBMgr::sTotalDevices = (int)devices.size();
+	}
+	if(replaced) device_removed(replaced);
+
+	debug("camera arrived at %s\n", path.c_str());
+	if(hotplugCallback) hotplugCallback(hotplugUserData, cam, true);
+}
+
+void PS3EYECam::device_left(libusb_device *dev)
+{
+	PS3EYERef cam;
+	{
+		std::lock_guard<std::mutex> lock(devices_lock);
+		for(size_t i = 0; i < devices.size(); i++)
+		{
+			if(devices[i]->device_ != dev) continue;
+			cam = devices[i];
+			devices.erase(devices.begin() + i);
+			USBMgr::sTotalDevices = (int)devices.size();
+			break;
+		}
+	}
+	if(cam) device_removed(cam);
+}
+
+// a camera taken off the list; parked so that the app callback or the
+// end of updateDevices()/getDevices() drops the last reference, not the
+// libusb event handling
+void PS3EYECam::device_removed(PS3EYERef cam)
+{
+	cam->connected = false;
+	debug("camera left %s\n", cam->port_path.c_str());
+	{
+		std::lock_guard<std::mutex> lock(devices_lock);
+		departed_devices.push_back(cam);
+	}
+	if(hotplugCallback) hotplugCallback(hotplugUserData, cam, false);
 }
 
 PS3EYECam::PS3EYECam(libusb_device *device)
@@ -734,12 +1326,45 @@ PS3EYECam::PS3EYECam(libusb_device *device)
     flip_h = false;
     flip_v = false;
 
+	frame_width = 0;
+	frame_height = 0;
+	frame_stride = 0;
+	frame_x = 0;
+	frame_y = 0;
+	frame_roi = false;
+	frame_format = FORMAT_YUYV;
+	row_bytes = 0;
+	bayer_output = BAYER_RAW;
+	bayer_method = DEMOSAIC_BILINEAR;
+	bayer_buf = NULL;
+	memset(&last_frame_info, 0, sizeof(last_frame_info));
+	memset(&bandwidth_decision, 0, sizeof(bandwidth_decision));
+	transfer_size = 0;
+	watchdog = true;
+	watchdog_failures = 0;
+	watchdog_time = 0;
+	recovery_count = 0;
+	frame_rate = 0;
+	frame_rate_target = 0;
+	frame_rate_exact = 0;
+	line_period = 0;
+	dummy_lines = 0;
+	delay_frame = 0;
+	delay_written = false;
+	stream_on = false;
+	bracket_pos = 0;
+	bracket_frame = 0;
+	bracket_written = false;
+	control_latency = 2;
+
 	usb_buf = NULL;
 	handle_ = NULL;
 
 	is_streaming = false;
 
 	device_ = device;
+	connected = true;
+	port_path = USBMgr::portPath(device);
 	mgrPtr = USBMgr::instance();
 	urb = std::shared_ptr<URBDesc>( new URBDesc() );
 }
@@ -755,9 +1380,51 @@ void PS3EYECam::release()
 	if(handle_ != NULL) 
 		close_usb();
 	if(usb_buf) free(usb_buf);
+	usb_buf = NULL;
+	if(bayer_buf) free(bayer_buf);
+	bayer_buf = NULL;
 }
 
 bool PS3EYECam::init(uint32_t width, uint32_t height, uint8_t desiredFrameRate)
+{
+	// find best cam mode
+	if((width == 0 && height == 0) || width > 320 || height > 240)
+	{
+		frame_width = 640;
+		frame_height = 480;
+	} else {
+		frame_width = 320;
+		frame_height = 240;
+	}
+	frame_x = 0;
+	frame_y = 0;
+	frame_roi = false;
+
+	return init_sensor(desiredFrameRate);
+}
+
+bool PS3EYECam::initROI(uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint8_t desiredFrameRate)
+{
+	// the bridge counts the frame in blocks of 8 pixels and lines,
+	// and an odd x offset would split the YUYV macropixels. Odd offsets
+	// would also shift the Bayer pattern getBayerPattern() reports.
+	if(width == 0 || height == 0 || (width & 7) || (height & 7) || (x & 1) || (y & 1) ||
+		x + width > 640 || y + height > 480)
+	{
+		debug("invalid ROI %dx%d at %d,%d\n", width, height, x, y);
+		return false;
+	}
+
+	frame_width = width;
+	frame_height = height;
+	frame_x = x;
+	frame_y = y;
+	frame_roi = true;
+
+	return init_sensor(desiredFrameRate);
+}
+
+bool PS3EYECam::init_sensor(uint8_t desiredFrameRate)
 {
 	uint16_t sensor_id;
 
@@ -774,17 +1441,18 @@ bool PS3EYECam::init(uint32_t width, uint32_t height, uint8_t desiredFrameRate)
 	if(usb_buf == NULL)
 		usb_buf = (uint8_t*)malloc(64);
 
-	// find best cam mode
-	if((width == 0 && height == 0) || width > 320 || height > 240)
-	{
-		frame_width = 640;
-		frame_height = 480;
-	} else {
-		frame_width = 320;
-		frame_height = 240;
+    frame_stride = frame_width * (frame_format == FORMAT_BAYER ? 1 : 2);
+	frame_rate_target = desiredFrameRate;
+	frame_rate_exact = ov534_set_frame_rate(frame_rate_target, true);
+	if (frame_rate_exact <= 0) {
+		return false;
+	}
+	if (!plan_bandwidth()) {
+		frame_rate_exact = 0;
+		return false;
 	}
-	frame_rate = ov534_set_frame_rate(desiredFrameRate, true);
-    frame_stride = frame_width * 2;
+	frame_rate = (uint8_t)(frame_rate_exact + 0.5);
+	setBayerOutput(bayer_output, bayer_method);
 	//
 
 	/* reset bridge */
@@ -825,11 +1493,176 @@ bool PS3EYECam::init(uint32_t width, uint32_t height, uint8_t desiredFrameRate)
 	return true;
 }
 
-void PS3EYECam::start()
+/* Bandwidth admission. Each bus gets a budget in bytes per second and
+ * every camera that has been initialized reserves the rate of its mode,
+ * whether streaming or not. The default is the bulk throughput a USB 2.0
+ * host controller sustains in practice; two VGA@60 YUYV streams (37 MB/s
+ * each) do not fit. */
+#define DEFAULT_BUS_BANDWIDTH	40000000.0
+
+BandwidthPolicy PS3EYECam::bandwidthPolicy = BANDWIDTH_ALLOW;
+static double default_bus_bandwidth = DEFAULT_BUS_BANDWIDTH;
+static std::map<uint8_t, double> bus_bandwidth;
+
+void PS3EYECam::setBusBandwidth(double bytesPerSecond, int bus)
+{
+	if (bus < 0) {
+		default_bus_bandwidth = bytesPerSecond;
+		bus_bandwidth.clear();
+	} else {
+		bus_bandwidth[(uint8_t)bus] = bytesPerSecond;
+	}
+}
+
+double PS3EYECam::getBusBandwidth(uint8_t bus)
+{
+	std::map<uint8_t, double>::const_iterator it = bus_bandwidth.find(bus);
+	return it != bus_bandwidth.end() ? it->second : default_bus_bandwidth;
+}
+
+double PS3EYECam::getBusBandwidthUsed(uint8_t bus)
+{
+	double used = 0;
+	std::lock_guard<std::mutex> lock(devices_lock);
+	for (size_t i = 0; i < devices.size(); i++) {
+		if (devices[i]->getBusNumber() == bus)
+			used += devices[i]->getBandwidth();
+	}
+	return used;
+}
+
+double PS3EYECam::getBandwidth() const
+{
+	if (handle_ == NULL || !connected) return 0;
+	return frame_stride * frame_height * frame_rate_exact;
+}
+
+void PS3EYECam::set_frame_size(uint32_t width, uint32_t height, uint32_t y)
+{
+	frame_width = width;
+	frame_height = height;
+	frame_y = y;
+	frame_stride = frame_width * (frame_format == FORMAT_BAYER ? 1 : 2);
+}
+
+/* lower the frame rate of the current frame size until it fits, but not
+ * below min_rate; the rate granted becomes the target start_sensor()
+ * programs */
+bool PS3EYECam::fit_frame_rate(double available, double min_rate)
+{
+	double rate = (std::min)(frame_rate_target, std::floor(available / (frame_stride * frame_height)));
+
+	for (; rate >= min_rate && rate >= 1.0; rate -= 1.0) {
+		double exact = ov534_set_frame_rate(rate, true);
+		if (exact > 0 && exact * frame_stride * frame_height <= available) {
+			frame_rate_target = rate;
+			frame_rate_exact = exact;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* check the mode picked by init() against what is left on the bus, and
+ * refuse or downgrade it according to the bandwidth policy */
+bool PS3EYECam::plan_bandwidth()
+{
+	BandwidthDecision &d = bandwidth_decision;
+	uint8_t bus = getBusNumber();
+	uint32_t width = frame_width, height = frame_height, y = frame_y;
+	double min_rate = std::ceil(frame_rate_target / 2);
+	double available;
+
+	d.requested = frame_stride * frame_height * frame_rate_exact;
+	d.bus_budget = getBusBandwidth(bus);
+	d.bus_used = 0;
+	{
+		std::lock_guard<std::mutex> lock(devices_lock);
+		for (size_t i = 0; i < devices.size(); i++) {
+			if (devices[i].get() != this && devices[i]->getBusNumber() == bus)
+				d.bus_used += devices[i]->getBandwidth();
+		}
+	}
+	available = d.bus_budget - d.bus_used;
+
+	if (d.requested <= available || bandwidthPolicy == BANDWIDTH_ALLOW) {
+		d.result = d.requested <= available ? BANDWIDTH_OK : BANDWIDTH_OVERSUBSCRIBED;
+	} else if (bandwidthPolicy == BANDWIDTH_DOWNGRADE && fit_frame_rate(available, min_rate)) {
+		d.result = BANDWIDTH_DOWNGRADED;
+	} else if (bandwidthPolicy == BANDWIDTH_DOWNGRADE && !frame_roi && frame_width == 640 &&
+			   (set_frame_size(320, 240, 0), fit_frame_rate(available, min_rate))) {
+		d.result = BANDWIDTH_DOWNGRADED;
+	} else if (bandwidthPolicy == BANDWIDTH_DOWNGRADE && frame_roi) {
+		/* fewer lines around the center of the window, at the requested rate */
+		uint32_t lines = frame_rate_target > 0 ?
+			(uint32_t)(available / (frame_stride * frame_rate_target)) & ~7u : 0;
+		d.result = BANDWIDTH_REFUSED;
+		for (lines = (std::min)(lines, height); lines >= 8; lines -= 8) {
+			set_frame_size(width, lines, y + (height - lines) / 2);
+			if (fit_frame_rate(available, frame_rate_target)) {
+				d.result = BANDWIDTH_DOWNGRADED;
+				break;
+			}
+		}
+	} else {
+		d.result = BANDWIDTH_REFUSED;
+	}
+
+	if (d.result == BANDWIDTH_REFUSED) {
+		set_frame_size(width, height, y);
+		debug("bus %d: %.1f MB/s needed, %.1f MB/s left, refused\n",
+			  bus, d.requested / 1e6, available / 1e6);
+		d.granted = 0;
+		d.width = d.height = 0;
+		d.frame_rate = 0;
+		return false;
+	}
+
+	d.granted = frame_stride * frame_height * frame_rate_exact;
+	d.width = frame_width;
+	d.height = frame_height;
+	d.frame_rate = frame_rate_exact;
+	if (d.result != BANDWIDTH_OK) {
+		debug("bus %d: %.1f MB/s needed, %.1f MB/s left, %s %dx%d@%.2f\n",
+			  bus, d.requested / 1e6, available / 1e6,
+			  d.result == BANDWIDTH_DOWNGRADED ? "downgraded to" : "oversubscribed",
+			  frame_width, frame_height, frame_rate_exact);
+	}
+	return true;
+}
+
+void PS3EYECam::start(bool enableStream)
 {
     if(is_streaming) return;
-    
-	if (frame_width == 320) {	/* 320x240 */
+
+	start_sensor(enableStream);
+
+	// init and start urb
+	urb->start_transfers(handle_, frame_stride*frame_height, frame_stride, frame_format, bulk_transfer_size());
+	urb->reset_settings(capture_settings());
+	bracket_pos = 0;
+	bracket_written = false;
+	last_qued_frame_time = 0;
+	watchdog_failures = 0;
+	watchdog_time = (double)getTickCount();
+    is_streaming = true;
+}
+
+void PS3EYECam::streamOn()
+{
+	if(!is_streaming || stream_on) return;
+
+	ov534_reg_write(0xe0, 0x00); // start stream
+	stream_on = true;
+	watchdog_time = (double)getTickCount();
+}
+
+// mode, frame rate and controls, then start the bridge streaming
+void PS3EYECam::start_sensor(bool enable_stream)
+{
+	if (frame_roi) {
+		ov534_set_window();
+	} else if (frame_width == 320) {	/* 320x240 */
 		reg_w_array(bridge_start_qvga, ARRAY_SIZE(bridge_start_qvga));
 		sccb_w_array(sensor_start_qvga, ARRAY_SIZE(sensor_start_qvga));
 	} else {		/* 640x480 */
@@ -837,7 +1670,13 @@ void PS3EYECam::start()
 		sccb_w_array(sensor_start_vga, ARRAY_SIZE(sensor_start_vga));
 	}
 
-	ov534_set_frame_rate(frame_rate);
+	if (frame_format == FORMAT_BAYER) {
+		/* one byte per pixel, COM7 output format: processed bayer raw */
+		if (!frame_roi) ov534_set_bridge_frame();
+		sccb_reg_write(0x12, (!frame_roi && frame_width == 320 ? 0x40 : 0x00) | 0x01);
+	}
+
+	ov534_set_frame_rate(frame_rate_target);
 
 	setAutogain(autogain);
 	setAutoWhiteBalance(awb);
@@ -853,12 +1692,12 @@ void PS3EYECam::start()
     setFlip(flip_h, flip_v);
 
 	ov534_set_led(1);
-	ov534_reg_write(0xe0, 0x00); // start stream
-
-	// init and start urb
-	urb->start_transfers(handle_, frame_stride*frame_height);
-	last_qued_frame_time = 0;
-    is_streaming = true;
+	// the frame rate above wrote the normal dummy lines
+	delay_written = false;
+	urb->delay_lines = 0;
+	urb->delay_busy = false;
+	stream_on = false;
+	if(enable_stream) streamOn();
 }
 
 void PS3EYECam::stop()
@@ -867,6 +1706,7 @@ void PS3EYECam::stop()
 
 	/* stop streaming data */
 	ov534_reg_write(0xe0, 0x09);
+	stream_on = false;
 	ov534_set_led(0);
     
 	// close urb
@@ -875,6 +1715,201 @@ void PS3EYECam::stop()
     is_streaming = false;
 }
 
+/* Stream watchdog, run from updateDevices(). A stream that hit a transfer
+ * error or has not completed a frame for several frame periods is
+ * restarted: first by clearing the endpoint halt and resubmitting the
+ * transfers, and if that keeps failing by redoing the whole start
+ * sequence. Consecutive failures back off up to WATCHDOG_MAX_TIMEOUT,
+ * also when the transfers died and none are left; an unplugged device
+ * is not retried. */
+#define WATCHDOG_PERIODS		8
+#define WATCHDOG_MIN_TIMEOUT	0.25
+#define WATCHDOG_MAX_TIMEOUT	5.0
+#define WATCHDOG_SOFT_ATTEMPTS	2
+
+void PS3EYECam::check_stream()
+{
+	if(!is_streaming || !connected) return;
+
+	if(stream_on)
+	{
+		check_delay();
+		write_bracket();
+	}
+
+	// a stream held back for streamOn() is not stalled
+	if(!watchdog || !stream_on) return;
+
+	double freq = getTickFrequency();
+	double now = getTickCount() / freq;
+	double last = (std::max)(urb->last_frame_time, watchdog_time) / freq;
+	double timeout = (std::max)(WATCHDOG_PERIODS / frame_rate_exact, WATCHDOG_MIN_TIMEOUT);
+
+	if(urb->device_gone)
+	{
+		debug("watchdog: device gone, not restarting\n");
+		connected = false;
+		return;
+	}
+
+	if(urb->last_frame_time > watchdog_time)
+	{
+		// frames are flowing again after a recovery
+		watchdog_failures = 0;
+	}
+	timeout = (std::min)(timeout * (1 << (std::min)(watchdog_failures, 5u)), WATCHDOG_MAX_TIMEOUT);
+
+	// after an error the remaining transfers get cancelled, then none are
+	// left; the first error restarts at once, repeated ones wait
+	if(urb->num_transfers > 0 && now - last < timeout) return;
+	if(urb->num_transfers == 0 && watchdog_failures > 0 && now - watchdog_time / freq < timeout) return;
+
+	debug("watchdog: restarting stream (%s, attempt %d)\n",
+		  urb->stream_error ? "transfer error" : "stall", watchdog_failures + 1);
+	recovery_count++;
+	watchdog_failures++;
+
+	urb->close_transfers();
+	if(watchdog_failures <= WATCHDOG_SOFT_ATTEMPTS)
+	{
+		urb->submit_transfers(handle_, urb->stats.transfer_size);
+	}
+	else
+	{
+		// full start sequence, keeps the ring and counters; app side
+		// register writes wait for the whole of it
+		std::lock_guard<std::recursive_mutex> lock(urb->reg_lock);
+		ov534_reg_write(0xe0, 0x09);
+		start_sensor();
+		urb->submit_transfers(handle_, urb->stats.transfer_size);
+	}
+	watchdog_time = (double)getTickCount();
+}
+
+CaptureSettings PS3EYECam::capture_settings() const
+{
+	CaptureSettings s;
+	s.exposure = exposure;
+	s.gain = gain;
+	s.red_balance = redblc;
+	s.blue_balance = blueblc;
+	s.green_balance = greenblc;
+	s.autogain = autogain;
+	s.awb = awb;
+	return s;
+}
+
+void PS3EYECam::settings_written()
+{
+	if(!is_streaming) return;
+	uint32_t done = getFrameCount();
+	urb->push_settings(capture_settings(), -1, done, done + control_latency);
+}
+
+void PS3EYECam::setBracketing(const std::vector<BracketStep> &steps)
+{
+	bracket_request = steps;
+	{
+		std::lock_guard<std::mutex> lock(urb->bracket_lock);
+		urb->bracket_next = steps;
+		urb->bracket_changed = true;
+	}
+	if(!steps.empty() && autogain) setAutogain(false);
+}
+
+/* Write the next bracketing step once per completed frame. The callbacks
+ * may run during the control transfers, so frames completed meanwhile are
+ * marked as not belonging to either step. A list handed over by
+ * setBracketing() starts here from its first step. */
+void PS3EYECam::write_bracket()
+{
+	bool changed = false;
+	{
+		std::lock_guard<std::mutex> lock(urb->bracket_lock);
+		if(urb->bracket_changed)
+		{
+			bracket_steps.swap(urb->bracket_next);
+			urb->bracket_changed = false;
+			changed = true;
+		}
+	}
+	if(changed)
+	{
+		bracket_pos = 0;
+		bracket_written = false;
+		if(bracket_steps.empty())
+		{
+			// back to the manual settings
+			std::lock_guard<std::recursive_mutex> lock(urb->reg_lock);
+			write_gain(gain);
+			write_exposure(exposure);
+			settings_written();
+		}
+	}
+	if(bracket_steps.empty()) return;
+
+	uint32_t n = getFrameCount();
+	if(bracket_written && n == bracket_frame) return;
+
+	const BracketStep &step = bracket_steps[bracket_pos];
+	CaptureSettings settings = capture_settings();
+	settings.exposure = step.exposure;
+	settings.gain = step.gain;
+	{
+		// both registers of the step before any app side write
+		std::lock_guard<std::recursive_mutex> lock(urb->reg_lock);
+		write_exposure(step.exposure);
+		write_gain(step.gain);
+	}
+	uint32_t done = getFrameCount();
+
+	if(done != n) urb->push_settings(settings, -1, done, n + control_latency);
+	urb->push_settings(settings, (int16_t)bracket_pos, done, done + control_latency);
+	bracket_frame = done;
+	bracket_written = true;
+	bracket_pos = (bracket_pos + 1) % bracket_steps.size();
+}
+
+bool PS3EYECam::setFormat(FrameFormat format)
+{
+	if(is_streaming) return false;
+	// takes effect with the next init()/initROI()
+	frame_format = format;
+	return true;
+}
+
+void PS3EYECam::setTransferSize(uint32_t bytes)
+{
+	transfer_size = (bytes + PAYLOAD_SIZE - 1) / PAYLOAD_SIZE * PAYLOAD_SIZE;
+}
+
+/* Every 2048 byte payload carries a 12 byte header. A short payload ends
+ * each frame and completes the transfer early, so a transfer larger than
+ * a frame never helps. In auto mode the size keeps the completion rate
+ * around TARGET_TRANSFER_RATE. */
+uint32_t PS3EYECam::bulk_transfer_size() const
+{
+	uint32_t frame_payloads = (frame_stride * frame_height + PAYLOAD_SIZE - 13) / (PAYLOAD_SIZE - 12);
+	uint32_t max_size = frame_payloads * PAYLOAD_SIZE;
+	uint32_t size = transfer_size;
+
+	if (size == 0) {
+		double bytes_per_sec = (double)max_size * frame_rate_exact;
+		size = (uint32_t)std::ceil(bytes_per_sec / TARGET_TRANSFER_RATE / PAYLOAD_SIZE) * PAYLOAD_SIZE;
+		size = (std::max)(size, (uint32_t)DEFAULT_TRANSFER_SIZE);
+	}
+	return (std::min)(size, max_size);
+}
+
+TransferStats PS3EYECam::getTransferStats() const
+{
+	TransferStats s = urb->stats;
+	s.event_cpu_time = USBMgr::sEventCPUTime;
+	if(urb->start_time > 0)
+		s.elapsed = (getTickCount() - urb->start_time) / getTickFrequency();
+	return s;
+}
+
 bool PS3EYECam::isNewFrame() const
 {
 	if(last_qued_frame_time < urb->last_frame_time)
@@ -887,10 +1922,127 @@ bool PS3EYECam::isNewFrame() const
 const uint8_t* PS3EYECam::getLastFramePointer()
 {
 	last_qued_frame_time = urb->last_frame_time;
+	last_frame_info = urb->frame_meta[urb->frame_complete_ind];
 	const uint8_t* frame = const_cast<uint8_t*>(urb->frame_buffer + urb->frame_complete_ind * urb->frame_size);
+
+	if(frame_format == FORMAT_BAYER && bayer_buf != NULL)
+	{
+		static const FrameFormat formats[] = {
+			FORMAT_BAYER, FORMAT_RGB, FORMAT_BGR, FORMAT_RGBA, FORMAT_BGRA, FORMAT_GRAY
+		};
+		demosaic(frame, frame_stride, bayer_buf, row_bytes, frame_width, frame_height,
+				 getBayerPattern(), bayer_output, bayer_method);
+		last_frame_info.format = formats[bayer_output];
+		return bayer_buf;
+	}
 	return frame;
 }
 
+// the slot after the last completed frame is being written
+const uint8_t* PS3EYECam::getFramePointer(uint32_t sequence, FrameInfo *info) const
+{
+	uint32_t slot = sequence % RING_FRAMES;
+
+	if(urb->frame_buffer == NULL || urb->frame_seq - sequence - 1 >= RING_FRAMES - 1 ||
+		urb->frame_meta[slot].sequence != sequence)
+		return NULL;
+
+	if(info) *info = urb->frame_meta[slot];
+	return urb->frame_buffer + slot * urb->frame_size;
+}
+
+uint32_t PS3EYECam::getFrameCount() const
+{
+	return urb->frame_seq;
+}
+
+void PS3EYECam::setSliceCallback(uint32_t rows, SliceCallback callback, void *userData)
+{
+	urb->slice_rows = rows;
+	urb->slice_user = userData;
+	urb->slice_cb = rows > 0 ? callback : NULL;
+}
+
+const uint8_t* PS3EYECam::waitForRows(uint32_t sequence, uint32_t rows, double timeout)
+{
+	double freq = getTickFrequency();
+	double deadline = getTickCount() / freq + timeout;
+
+	rows = (std::min)(rows, frame_height);
+	for(;;)
+	{
+		// complete, or the frame being received has enough rows
+		if((int32_t)(urb->frame_seq - sequence) > 0)
+			return getFramePointer(sequence);
+		if(urb->frame_seq == sequence && urb->frame_rows >= rows)
+			return urb->frame_buffer + (sequence % RING_FRAMES) * urb->frame_size;
+
+		if(!is_streaming || getTickCount() / freq >= deadline)
+			return NULL;
+		USBMgr::instance()->handleEvents();
+	}
+}
+
+const ClockModel& PS3EYECam::getClockModel() const
+{
+	return urb->clock;
+}
+
+void PS3EYECam::setDenoise(float strength, uint8_t motionLow, uint8_t motionHigh)
+{
+	std::lock_guard<std::mutex> lock(urb->denoise_lock);
+	urb->denoise_next.strength = strength > 0 ? strength : 0;
+	urb->denoise_next.low = motionLow;
+	urb->denoise_next.high = motionHigh;
+	urb->denoise_changed = true;
+}
+
+float PS3EYECam::getDenoise() const
+{
+	std::lock_guard<std::mutex> lock(urb->denoise_lock);
+	return urb->denoise_next.strength;
+}
+
+void PS3EYECam::setCorrection(const std::shared_ptr<const FrameCorrection> &correction)
+{
+	std::lock_guard<std::mutex> lock(urb->correction_lock);
+	urb->correction = correction && correction->isValid() ? correction : std::shared_ptr<const FrameCorrection>();
+}
+
+std::shared_ptr<const FrameCorrection> PS3EYECam::getCorrection() const
+{
+	std::lock_guard<std::mutex> lock(urb->correction_lock);
+	return urb->correction;
+}
+
+void PS3EYECam::setBayerOutput(BayerOutput output, DemosaicMethod method)
+{
+	bayer_output = output;
+	bayer_method = method;
+
+	if(bayer_buf) free(bayer_buf);
+	bayer_buf = NULL;
+	row_bytes = frame_stride;
+
+	if(frame_format == FORMAT_BAYER && output != BAYER_RAW && frame_width > 0)
+	{
+		row_bytes = frame_width * bayerOutputBytes(output);
+		bayer_buf = (uint8_t*)malloc(row_bytes * frame_height);
+		if(bayer_buf == NULL) row_bytes = frame_stride;
+	}
+}
+
+/* The OV772x reads out BGGR with mirror and flip off, each of them moves
+ * the mosaic by one column or row. */
+BayerPattern PS3EYECam::getBayerPattern() const
+{
+	static const BayerPattern patterns[2][2] = {
+		{ BAYER_BGGR, BAYER_GRBG },	/* not mirrored: normal, flipped */
+		{ BAYER_GBRG, BAYER_RGGB },	/* mirrored */
+	};
+	return patterns[flip_h ? 1 : 0][flip_v ? 1 : 0];
+}
+
 bool PS3EYECam::open_usb()
 {
 	// open, set first config and claim interface
@@ -914,6 +2066,7 @@ bool PS3EYECam::open_usb()
 void PS3EYECam::close_usb()
 {
 	debug("closing device\n");
+	urb->free_transfer_buffers();
 	libusb_release_interface(handle_, 0);
 	libusb_close(handle_);
 	libusb_unref_device(device_);
@@ -926,6 +2079,7 @@ void PS3EYECam::close_usb()
  * (direction and output)? */
 void PS3EYECam::ov534_set_led(int status)
 {
+	std::lock_guard<std::recursive_mutex> lock(urb->reg_lock);
 	uint8_t data;
 
 	debug("led status: %d\n", status);
@@ -949,63 +2103,242 @@ void PS3EYECam::ov534_set_led(int status)
 	}
 }
 
-/* validate frame rate and (if not dry run) set it */
-uint8_t PS3EYECam::ov534_set_frame_rate(uint8_t frame_rate, bool dry_run)
-{
-     int i;
-     struct rate_s {
-             uint8_t fps;
-             uint8_t r11;
-             uint8_t r0d;
-             uint8_t re5;
-     };
-     const struct rate_s *r;
-     static const struct rate_s rate_0[] = { /* 640x480 */
-             {60, 0x01, 0xc1, 0x04},
-             {50, 0x01, 0x41, 0x02},
-             {40, 0x02, 0xc1, 0x04},
-             {30, 0x04, 0x81, 0x02},
-             {15, 0x03, 0x41, 0x04},
-     };
-     static const struct rate_s rate_1[] = { /* 320x240 */
-             {205, 0x01, 0xc1, 0x02}, /* 205 FPS: video is partly corrupt */
-             {187, 0x01, 0x81, 0x02}, /* 187 FPS or below: video is valid */
-             {150, 0x01, 0xc1, 0x04},
-             {137, 0x02, 0xc1, 0x02},
-             {125, 0x02, 0x81, 0x02},
-             {100, 0x02, 0xc1, 0x04},
-             {75, 0x03, 0xc1, 0x04},
-             {60, 0x04, 0xc1, 0x04},
-             {50, 0x02, 0x41, 0x04},
-             {37, 0x03, 0x41, 0x04},
-             {30, 0x04, 0x41, 0x04},
-     };
-
-     if (frame_width == 640) {
-             r = rate_0;
-             i = ARRAY_SIZE(rate_0);
-     } else {
-             r = rate_1;
-             i = ARRAY_SIZE(rate_1);
-     }
-     while (--i > 0) {
-             if (frame_rate >= r->fps)
-                     break;
-             r++;
-     }
-
-     if (!dry_run) {
-         sccb_reg_write(0x11, r->r11);
-         sccb_reg_write(0x0d, r->r0d);
-         ov534_reg_write(0xe5, r->re5);
-    }
+/* Frame timing of the OV772x.  A frame lasts 2 * hts * vts pixel clocks,
+ * the pixel clock being the sensor input clock (supplied by the bridge and
+ * selected with bridge register 0xe5) times the PLL multiplier (COM4 0x0d
+ * bits 7:6) divided by CLKRC (0x11) + 1.  These constants reproduce the
+ * entries of the original ov534 rate tables. */
+#define OV772X_VGA_HTS		784
+#define OV772X_VGA_VTS		510
+#define OV772X_QVGA_HTS		576
+#define OV772X_QVGA_VTS		278
+#define OV772X_MAX_PCLK		60000000.0	/* 205 fps QVGA (80 MHz) is corrupt */
+#define OV772X_MAX_DUMMY_PIXELS	0x0fff
+#define OV772X_MAX_DUMMY_LINES	0xffff
+#define OV534_MAX_BYTES_PER_SEC	(640.0 * 2 * 480 * 60)	/* VGA@60 YUYV */
+
+struct frame_timing {
+	uint8_t r11;		/* CLKRC */
+	uint8_t r0d;		/* COM4, PLL */
+	uint8_t re5;		/* bridge sensor clock */
+	uint16_t dummy_pixels;	/* EXHCH/EXHCL */
+	uint16_t dummy_lines;	/* DM_LNH/DM_LNL */
+	double fps;
+};
 
-     debug("frame_rate: %d\n", r->fps);
-     return r->fps;
+/* find the clock dividers and padding that get closest to the requested
+ * rate; returns false if no setting can be found */
+static bool ov772x_solve_frame_rate(double fps, uint32_t hts, uint32_t vts, uint32_t frame_bytes,
+									struct frame_timing *out)
+{
+	static const struct { uint8_t re5; double xclk; } clocks[] = {
+		{ 0x04, 12000000.0 },
+		{ 0x02, 20000000.0 },
+	};
+	static const struct { uint8_t r0d; uint32_t mul; } plls[] = {
+		{ 0x41, 4 },
+		{ 0x81, 6 },
+		{ 0xc1, 8 },
+	};
+	const double base = 2.0 * hts * vts;
+	double max_fps = (std::min)(OV534_MAX_BYTES_PER_SEC / frame_bytes, OV772X_MAX_PCLK / base);
+	double tolerance;
+	double best_err = -1, best_pad = 0;
+	size_t c, p;
+	uint32_t div;
+
+	if (fps > max_fps) fps = max_fps;
+	if (fps < 1.0) fps = 1.0;
+	/* anything this close is as good as exact, prefer the least padding */
+	tolerance = fps * 0.001;
+
+	for (c = 0; c < ARRAY_SIZE(clocks); c++) {
+		for (p = 0; p < ARRAY_SIZE(plls); p++) {
+			for (div = 1; div <= 0x3f; div++) {
+				double pclk = clocks[c].xclk * plls[p].mul / (div + 1);
+				double needed = pclk / fps;
+				double lines, pixels, eff, err, pad;
+
+				if (pclk > OV772X_MAX_PCLK || pclk / base < fps - tolerance)
+					continue;
+
+				lines = (std::max)(0.0, std::floor((needed - base) / (2.0 * hts)));
+				if (lines > OV772X_MAX_DUMMY_LINES)
+					continue;
+				pixels = (std::max)(0.0, std::floor((needed - 2.0 * hts * (vts + lines)) / (2.0 * (vts + lines)) + 0.5));
+				if (pixels > OV772X_MAX_DUMMY_PIXELS)
+					continue;
+
+				eff = pclk / (2.0 * (hts + pixels) * (vts + lines));
+				if (eff > max_fps + tolerance)
+					continue;
+				err = std::fabs(eff - fps);
+				pad = (hts + pixels) * (vts + lines) / (double)(hts * vts);
+
+				if (best_err < 0 ||
+					(err <= tolerance && (best_err > tolerance || pad < best_pad)) ||
+					(err > tolerance && best_err > tolerance && err < best_err)) {
+					best_err = err;
+					best_pad = pad;
+					out->r11 = (uint8_t)div;
+					out->r0d = plls[p].r0d;
+					out->re5 = clocks[c].re5;
+					out->dummy_pixels = (uint16_t)pixels;
+					out->dummy_lines = (uint16_t)lines;
+					out->fps = eff;
+				}
+			}
+		}
+	}
+
+	return best_err >= 0;
+}
+
+/* validate frame rate and (if not dry run) set it, returns the exact rate */
+double PS3EYECam::ov534_set_frame_rate(double frame_rate, bool dry_run)
+{
+	struct frame_timing t = {};
+	uint32_t hts, vts;
+
+	if (frame_roi) {
+		/* the window keeps the VGA line length but only needs its own
+		   lines plus the vertical blanking of the full frame */
+		hts = OV772X_VGA_HTS;
+		vts = frame_height + (OV772X_VGA_VTS - 480);
+	} else if (frame_width == 640) {
+		hts = OV772X_VGA_HTS;
+		vts = OV772X_VGA_VTS;
+	} else {
+		hts = OV772X_QVGA_HTS;
+		vts = OV772X_QVGA_VTS;
+	}
+
+	if (!ov772x_solve_frame_rate(frame_rate, hts, vts, frame_stride * frame_height, &t)) {
+		debug("no timing for frame_rate: %f\n", frame_rate);
+		return 0;
+	}
+
+	if (!dry_run) {
+		sccb_reg_write(0x11, t.r11);
+		sccb_reg_write(0x0d, t.r0d);
+		ov534_reg_write(0xe5, t.re5);
+		sccb_reg_write(0x2a, (t.dummy_pixels >> 8) << 4);
+		sccb_reg_write(0x2b, t.dummy_pixels & 0xff);
+		sccb_reg_write(0x33, t.dummy_lines & 0xff);
+		sccb_reg_write(0x34, t.dummy_lines >> 8);
+		dummy_lines = t.dummy_lines;
+		line_period = 1.0 / (t.fps * (vts + t.dummy_lines));
+	}
+
+	debug("frame_rate: %f (clkrc 0x%02x, pll 0x%02x, e5 0x%02x, dummy %d px %d lines)\n",
+		t.fps, t.r11, t.r0d, t.re5, t.dummy_pixels, t.dummy_lines);
+	return t.fps;
+}
+
+bool PS3EYECam::delayFrame(double seconds)
+{
+	if (!is_streaming || urb->delay_busy || line_period <= 0 || seconds <= 0) return false;
+
+	uint32_t lines = (uint32_t)((std::min)(seconds, 1.0 / frame_rate_exact) / line_period + 0.5);
+	lines = (std::min)(lines, (uint32_t)OV772X_MAX_DUMMY_LINES - dummy_lines);
+	if (lines == 0) return false;
+
+	bool idle = false;
+	if (!urb->delay_busy.compare_exchange_strong(idle, true)) return false;
+	urb->delay_lines = lines;
+	return true;
+}
+
+bool PS3EYECam::isDelayingFrame() const
+{
+	return urb->delay_busy;
+}
+
+/* Dummy lines pad the vertical blanking of the frame they are latched
+ * for. Written and restored at the same point of two consecutive frames,
+ * away from the frame ends, they pad exactly one frame, whether the
+ * sensor takes them at once or from the next frame start. The position
+ * is in frame periods after the last completed frame. */
+#define DELAY_WINDOW_BEGIN	0.25
+#define DELAY_WINDOW_END	0.75
+
+void PS3EYECam::check_delay()
+{
+	if (!urb->delay_busy || urb->last_frame_time == 0) return;
+
+	double pos = (getTickCount() - urb->last_frame_time) / getTickFrequency() * frame_rate_exact;
+	bool mid_frame = pos >= DELAY_WINDOW_BEGIN && pos < DELAY_WINDOW_END;
+	uint32_t n = getFrameCount();
+
+	if (!delay_written) {
+		if (!mid_frame) return;
+		uint32_t lines = urb->delay_lines.exchange(0);
+		if (lines == 0) return;	// not handed over yet
+		lines = (std::min)(dummy_lines + lines, (uint32_t)OV772X_MAX_DUMMY_LINES);
+
+		std::lock_guard<std::recursive_mutex> lock(urb->reg_lock);
+		sccb_reg_write(0x33, lines & 0xff);
+		sccb_reg_write(0x34, lines >> 8);
+		delay_frame = n;
+		delay_written = true;
+	} else if (n != delay_frame && (mid_frame || n - delay_frame > 1)) {
+		// a late restore pads a second frame, nothing to be done about it
+		if (n - delay_frame > 1) {
+			debug("delayFrame: restored %u frames late\n", n - delay_frame - 1);
+		}
+
+		std::lock_guard<std::recursive_mutex> lock(urb->reg_lock);
+		sccb_reg_write(0x33, dummy_lines & 0xff);
+		sccb_reg_write(0x34, dummy_lines >> 8);
+		delay_written = false;
+		urb->delay_busy = false;
+	}
+}
+
+/* tell the bridge the payload and frame size of the current mode */
+void PS3EYECam::ov534_set_bridge_frame()
+{
+	uint32_t frame_words = frame_stride * frame_height / 4;
+
+	/* payload size 2048 bytes, frame size in 4 byte words */
+	ov534_reg_write(0x1c, 0x00);
+	ov534_reg_write(0x1d, 0x40);
+	ov534_reg_write(0x1d, 0x02);
+	ov534_reg_write(0x1d, 0x00);
+	ov534_reg_write(0x1d, (frame_words >> 16) & 0xff);
+	ov534_reg_write(0x1d, (frame_words >> 8) & 0xff);
+	ov534_reg_write(0x1d, frame_words & 0xff);
+	ov534_reg_write(0xc0, frame_width / 8);
+	ov534_reg_write(0xc1, frame_height / 8);
+}
+
+/* Program a sensor window inside the VGA frame and tell the bridge the
+ * matching frame geometry. The window origin is relative to the start of
+ * the active VGA area (HSTART 0x26 * 4, VSTART 0x07 * 2). */
+void PS3EYECam::ov534_set_window()
+{
+	uint32_t hstart = 0x26 * 4 + frame_x;
+	uint32_t vstart = 0x07 * 2 + frame_y;
+
+	ov534_set_bridge_frame();
+
+	/* sensor: VGA timing, window in HSTART/HSIZE/VSTART/VSIZE with the
+	   low bits in HREF, output size in HOutSize/VOutSize */
+	sccb_reg_write(0x12, 0x00);
+	sccb_reg_write(0x17, hstart >> 2);
+	sccb_reg_write(0x18, frame_width >> 2);
+	sccb_reg_write(0x19, vstart >> 1);
+	sccb_reg_write(0x1a, frame_height >> 1);
+	sccb_reg_write(0x32, ((vstart & 1) << 6) | ((hstart & 3) << 4) |
+						 ((frame_height & 1) << 2) | (frame_width & 3));
+	sccb_reg_write(0x29, frame_width >> 2);
+	sccb_reg_write(0x2c, frame_height >> 1);
+	sccb_reg_write(0x65, 0x20);
 }
 
 void PS3EYECam::ov534_reg_write(uint16_t reg, uint8_t val)
 {
+	std::lock_guard<std::recursive_mutex> lock(urb->reg_lock);
 	int ret;
 
 	//debug("reg=0x%04x, val=0%02x", reg, val);
@@ -1023,6 +2356,7 @@ void PS3EYECam::ov534_reg_write(uint16_t reg, uint8_t val)
 
 uint8_t PS3EYECam::ov534_reg_read(uint16_t reg)
 {
+	std::lock_guard<std::recursive_mutex> lock(urb->reg_lock);
 	int ret;
 
 	ret = libusb_control_transfer(handle_,
@@ -1063,6 +2397,7 @@ int PS3EYECam::sccb_check_status()
 
 void PS3EYECam::sccb_reg_write(uint8_t reg, uint8_t val)
 {
+	std::lock_guard<std::recursive_mutex> lock(urb->reg_lock);
 	//debug("reg: 0x%02x, val: 0x%02x", reg, val);
 	ov534_reg_write(OV534_REG_SUBADDR, reg);
 	ov534_reg_write(OV534_REG_WRITE, val);
@@ -1076,6 +2411,7 @@ void PS3EYECam::sccb_reg_write(uint8_t reg, uint8_t val)
 
 uint8_t PS3EYECam::sccb_reg_read(uint16_t reg)
 {
+	std::lock_guard<std::recursive_mutex> lock(urb->reg_lock);
 	ov534_reg_write(OV534_REG_SUBADDR, (uint8_t)reg);
 	ov534_reg_write(OV534_REG_OPERATION, OV534_OP_WRITE_2);
 	if (!sccb_check_status()) {
@@ -1089,9 +2425,18 @@ uint8_t PS3EYECam::sccb_reg_read(uint16_t reg)
 	
 	return ov534_reg_read(OV534_REG_READ);
 }
+// AEC high bits and AECH, as one update
+void PS3EYECam::write_exposure(uint8_t val)
+{
+	std::lock_guard<std::recursive_mutex> lock(urb->reg_lock);
+	sccb_reg_write(0x08, val>>7);
+	sccb_reg_write(0x10, val<<1);
+}
+
 /* output a bridge sequence (reg - val) */
 void PS3EYECam::reg_w_array(const uint8_t (*data)[2], int len)
 {
+	std::lock_guard<std::recursive_mutex> lock(urb->reg_lock);
 	while (--len >= 0) {
 		ov534_reg_write((*data)[0], (*data)[1]);
 		data++;
@@ -1101,6 +2446,7 @@ void PS3EYECam::reg_w_array(const uint8_t (*data)[2], int len)
 /* output a sensor sequence (reg - val) */
 void PS3EYECam::sccb_w_array(const uint8_t (*data)[2], int len)
 {
+	std::lock_guard<std::recursive_mutex> lock(urb->reg_lock);
 	while (--len >= 0) {
 		if ((*data)[0] != 0xff) {
 			sccb_reg_write((*data)[0], (*data)[1]);
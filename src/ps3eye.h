@@ -5,6 +5,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <vector>
+#include <string>
 
 // define shared_ptr in std 
 
@@ -22,7 +23,17 @@
     }
 #endif
 
+// The bundled libusb.h matches the bundled libusbx 1.0.15 libraries, which
+// have neither hotplug nor device memory transfer buffers. Define
+// PS3EYE_SYSTEM_LIBUSB to build against an installed libusb-1.0 instead,
+// which enables both where that version has them.
+#if defined(PS3EYE_SYSTEM_LIBUSB)
+#include <libusb-1.0/libusb.h>
+#else
 #include "libusb.h"
+#endif
+#include "ps3eye_demosaic.h"
+#include "ps3eye_clock.h"
 
 #ifndef __STDC_CONSTANT_MACROS
 #  define __STDC_CONSTANT_MACROS
@@ -39,6 +50,107 @@
 
 namespace ps3eye {
 
+enum FrameFormat
+{
+	FORMAT_YUYV = 0,	// 2 bytes per pixel, Y0 U Y1 V
+	FORMAT_BAYER,		// 1 byte per pixel, raw mosaic from the sensor
+	// host side conversions of FORMAT_BAYER, see setBayerOutput()
+	FORMAT_RGB,
+	FORMAT_BGR,
+	FORMAT_RGBA,
+	FORMAT_BGRA,
+	FORMAT_GRAY
+};
+
+// sensor settings a frame was captured with
+struct CaptureSettings
+{
+	uint8_t exposure;
+	uint8_t gain;
+	uint8_t red_balance;
+	uint8_t blue_balance;
+	uint8_t green_balance;
+	bool autogain;
+	bool awb;
+};
+
+// one step of an exposure bracketing cycle
+struct BracketStep
+{
+	uint8_t exposure;
+	uint8_t gain;
+};
+
+// metadata kept alongside each frame of the ring
+struct FrameInfo
+{
+	uint32_t sequence;	// frames completed since start()
+	uint32_t pts;		// device timestamp from the payload header
+	double timestamp;	// host time in seconds when the frame completed
+	double device_time;	// the same from the pts through the clock model, without
+						// the USB jitter; equals timestamp until the model is valid
+	FrameFormat format;
+	CaptureSettings settings;	// as last written, the sensor picks its own under autogain
+	uint32_t settings_sequence;	// frame being received when they were written
+	bool settings_pending;	// newer settings were written before this frame completed
+							// but are due later, it may show either (true throughout
+							// bracketing, which writes every frame; see bracket)
+	int16_t bracket;	// step of the bracketing cycle, -1 without bracketing and for
+						// frames taken while the registers were being written
+};
+
+// USB transfer counters since start()
+struct TransferStats
+{
+	uint64_t transfers;		// completed bulk transfers
+	uint64_t frames;		// completed frames
+	double callback_time;	// seconds spent parsing this camera's transfers
+	double event_cpu_time;	// CPU seconds (user + kernel) spent in updateDevices(),
+							// shared by all cameras
+	bool device_memory;		// transfer buffers mapped with libusb_dev_mem_alloc
+	uint32_t transfer_size;	// bytes per bulk transfer
+	double elapsed;			// seconds since start(), transfers / elapsed = callbacks per second
+};
+
+// root hub of the bus a camera is attached to
+struct USBController
+{
+	uint8_t bus;		// same as PS3EYECam::getBusNumber()
+	uint16_t vendor;	// root hub descriptor, identifies the host controller driver
+	uint16_t product;
+	int speed;			// libusb_speed of the root hub
+};
+
+// what init() does when a bus lacks the bandwidth for the requested mode
+enum BandwidthPolicy
+{
+	BANDWIDTH_ALLOW = 0,	// keep the mode, report BANDWIDTH_OVERSUBSCRIBED
+	BANDWIDTH_REFUSE,		// fail init()
+	BANDWIDTH_DOWNGRADE		// lower the frame rate (down to half), then use QVGA,
+							// then shrink an ROI window; fail if nothing fits
+};
+
+enum BandwidthResult
+{
+	BANDWIDTH_OK = 0,
+	BANDWIDTH_OVERSUBSCRIBED,
+	BANDWIDTH_DOWNGRADED,
+	BANDWIDTH_REFUSED
+};
+
+// outcome of the bandwidth check of the last init()
+struct BandwidthDecision
+{
+	BandwidthResult result;
+	double requested;	// bytes per second of the requested mode
+	double granted;		// bytes per second of the mode that was set up, 0 if refused
+	double bus_used;	// by the other initialized cameras on the bus
+	double bus_budget;
+	uint32_t width;		// mode that was set up
+	uint32_t height;
+	double frame_rate;
+};
+
 class PS3EYECam
 {
 public:
@@ -51,7 +163,13 @@ public:
 	~PS3EYECam();
 
 	bool init(uint32_t width = 0, uint32_t height = 0, uint8_t desiredFrameRate = 30);
-	void start();
+	// capture only a window of the VGA frame, width and height must be
+	// multiples of 8 and x, y even. Smaller windows allow higher frame rates.
+	bool initROI(uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint8_t desiredFrameRate = 60);
+	// enableStream false sets everything up but leaves the sensor output
+	// off until streamOn(), so a group can choose when each camera begins
+	void start(bool enableStream = true);
+	void streamOn();
 	void stop();
 
 	// Controls
@@ -66,9 +184,10 @@ public:
 			sccb_reg_write(0x13, 0xf0); //AGC,AEC,AWB OFF
 			sccb_reg_write(0x64, sccb_reg_read(0x64)&0xFC);
 
-			setGain(gain);
-			setExposure(exposure);
+			write_gain(gain);
+			write_exposure(exposure);
 	    }
+	    settings_written();
 	}
 	bool getAutoWhiteBalance() const { return awb; }
 	void setAutoWhiteBalance(bool val) {
@@ -78,34 +197,19 @@ public:
 	    }else{
 			sccb_reg_write(0x63, 0xAA); //AWB OFF
 	    }
+	    settings_written();
 	}
 	uint8_t getGain() const { return gain; }
 	void setGain(uint8_t val) {
 	    gain = val;
-	    switch(val & 0x30){
-		case 0x00:
-		    val &=0x0F;
-		    break;
-		case 0x10:
-		    val &=0x0F;
-		    val |=0x30;
-		    break;
-		case 0x20:
-		    val &=0x0F;
-		    val |=0x70;
-		    break;
-		case 0x30:
-		    val &=0x0F;
-		    val |=0xF0;
-		    break;
-	    }
-	    sccb_reg_write(0x00, val);
+	    write_gain(val);
+	    settings_written();
 	}
 	uint8_t getExposure() const { return exposure; }
 	void setExposure(uint8_t val) {
 	    exposure = val;
-	    sccb_reg_write(0x08, val>>7);
-    	sccb_reg_write(0x10, val<<1);
+	    write_exposure(val);
+	    settings_written();
 	}
 	uint8_t getSharpness() const { return sharpness; }
 	void setSharpness(uint8_t val) {
@@ -132,16 +236,19 @@ public:
 	void setRedBalance(uint8_t val) {
 		redblc = val;
 		sccb_reg_write(0x43, val);
+		settings_written();
 	}
 	uint8_t getBlueBalance() const { return blueblc; }
 	void setBlueBalance(uint8_t val) {
 		blueblc = val;
 		sccb_reg_write(0x42, val);
+		settings_written();
 	}
 	uint8_t getGreenBalance() const { return greenblc; }
 	void setGreenBalance(uint8_t val) {
 		greenblc = val;
 		sccb_reg_write(0x44, val);
+		settings_written();
 	}
 	void setFlip(bool horizontal = false, bool vertical = false) {
         flip_h = horizontal;
@@ -157,25 +264,162 @@ public:
     bool isStreaming() const { return is_streaming; }
 	bool isNewFrame() const;
 	const uint8_t* getLastFramePointer();
+	// bytes per bulk transfer, rounded up to the 2048 byte payload and
+	// capped at one frame. 0 (default) picks a size from the mode so high
+	// frame rates wake the event loop less often. Applies on start().
+	void setTransferSize(uint32_t bytes);
+	uint32_t getTransferSize() const { return transfer_size; }
+	// restart stalled or failed streams from updateDevices(), on by default
+	void setWatchdog(bool enable) { watchdog = enable; }
+	bool getWatchdog() const { return watchdog; }
+	// number of times the watchdog restarted the stream
+	uint32_t getRecoveryCount() const { return recovery_count; }
+	// Shift the frame phase later by lengthening the blanking of one frame
+	// with dummy lines, rounded to whole lines and at most one frame.
+	// updateDevices() writes them mid-frame and restores the normal timing
+	// mid-frame one frame later, so exactly one frame is padded.
+	bool delayFrame(double seconds);
+	bool isDelayingFrame() const;
+
+	// Frames still held in the ring, by FrameInfo::sequence. The ring keeps
+	// the last 15 completed frames; the pointer is to the raw frame (no
+	// Bayer conversion) and stays valid until the camera completes 15 more,
+	// which can only happen inside updateDevices(). NULL if overwritten.
+	const uint8_t* getFramePointer(uint32_t sequence, FrameInfo *info = NULL) const;
+	// frames completed since start(), the next frame gets this sequence
+	uint32_t getFrameCount() const;
+
+	// Row slices of the frame being received, for work that can start
+	// before the whole frame is in. The callback runs in the thread that
+	// calls updateDevices() each time another `rows` rows (and the last
+	// rows) of the raw frame have arrived, with the new rows in
+	// [rowBegin, rowEnd); the row stride is the raw stride, width times 2
+	// for YUYV and 1 for Bayer. A frame that turns out corrupt is
+	// received again from row 0 under the same sequence. rows 0 disables.
+	typedef void (*SliceCallback)(void *userData, const uint8_t *frame, uint32_t sequence,
+								  uint32_t rowBegin, uint32_t rowEnd);
+	void setSliceCallback(uint32_t rows, SliceCallback callback, void *userData);
+	// Block until frame `sequence` has at least `rows` rows, handling USB
+	// events meanwhile (so it works with or without a thread running
+	// updateDevices()). Returns the raw frame, NULL on timeout or if the
+	// frame is no longer in the ring.
+	const uint8_t* waitForRows(uint32_t sequence, uint32_t rows, double timeout);
+
+	// Exposure bracketing: cycle exposure and gain through the steps on
+	// consecutive frames. The registers are written from updateDevices(),
+	// once per frame, never from the transfer callbacks; FrameInfo::bracket
+	// and FrameInfo::settings tell which step each frame was taken with.
+	// Turns autogain off. An empty list stops and restores the exposure
+	// and gain set before. The list is handed over to updateDevices(),
+	// which switches at its next frame.
+	void setBracketing(const std::vector<BracketStep> &steps);
+	const std::vector<BracketStep>& getBracketing() const { return bracket_request; }
+	// frames from a register write to the first frame taken with it, default 2:
+	// a write made while frame n is received applies from frame n + latency
+	void setControlLatency(uint32_t frames) { control_latency = frames; }
+	uint32_t getControlLatency() const { return control_latency; }
+
+	// pts to host time mapping of the running stream
+	const ClockModel& getClockModel() const;
+
+	// CPU per frame is event_cpu_time over the frames of all cameras
+	TransferStats getTransferStats() const;
+	// metadata of the frame returned by the last getLastFramePointer()
+	const FrameInfo& getLastFrameInfo() const { return last_frame_info; }
 
 	uint32_t getWidth() const { return frame_width; }
 	uint32_t getHeight() const { return frame_height; }
+	bool isROI() const { return frame_roi; }
+	uint32_t getROIX() const { return frame_x; }
+	uint32_t getROIY() const { return frame_y; }
 	uint8_t getFrameRate() const { return frame_rate; }
-	uint32_t getRowBytes() const { return frame_stride; }
-
-	//
-	static const std::vector<PS3EYERef>& getDevices( bool forceRefresh = false );
+	// exact rate produced by the computed sensor timing
+	double getFrameRateExact() const { return frame_rate_exact; }
+	uint32_t getRowBytes() const { return row_bytes; }
+
+	// output format, set before init(). FORMAT_BAYER halves the bandwidth
+	// of a mode and allows higher frame rates.
+	bool setFormat(FrameFormat format);
+	FrameFormat getFormat() const { return frame_format; }
+	// convert FORMAT_BAYER frames in getLastFramePointer(), getRowBytes()
+	// and getLastFrameInfo() then describe the converted frame
+	void setBayerOutput(BayerOutput output, DemosaicMethod method = DEMOSAIC_BILINEAR);
+	BayerOutput getBayerOutput() const { return bayer_output; }
+	// Recursive temporal noise filter (see ps3eye_denoise.h) run on the raw
+	// frame as its rows arrive, so the ring, slices and all readers get the
+	// filtered frames. strength is the share of the previous frame kept
+	// where nothing moves, 0 (default) turns it off. Takes effect with the
+	// next frame.
+	void setDenoise(float strength, uint8_t motionLow = 6, uint8_t motionHigh = 24);
+	float getDenoise() const;
+	// Dark frame and flat field correction (see ps3eye_correct.h) of the raw
+	// frame as its rows arrive, ahead of the noise filter. Used while its
+	// size matches the mode, frames already started keep the previous one.
+	// NULL turns it off.
+	void setCorrection(const std::shared_ptr<const class FrameCorrection> &correction);
+	std::shared_ptr<const class FrameCorrection> getCorrection() const;
+	// mosaic layout of FORMAT_BAYER frames for the current flip settings
+	BayerPattern getBayerPattern() const;
+
+	// false once the camera was unplugged
+	bool isConnected() const { return connected; }
+
+	// USB topology. Cameras on different buses do not share bandwidth.
+	uint8_t getBusNumber() const { return libusb_get_bus_number(device_); }
+	// "bus-port.port...", stable across reboots for a given socket
+	const std::string& getPortPath() const { return port_path; }
+	// changes on every replug
+	uint8_t getDeviceAddress() const { return libusb_get_device_address(device_); }
+	// libusb_speed of the link, LIBUSB_SPEED_HIGH for a working camera
+	int getSpeed() const { return libusb_get_device_speed(device_); }
+	bool getController(USBController &controller) const;
+
+	// Cameras found on the bus. A refresh keeps the instances of cameras
+	// that are still present; with libusb hotplug support (a libusb-1.0
+	// built with PS3EYE_SYSTEM_LIBUSB, not the bundled one) the list is
+	// kept current by updateDevices() and a refresh costs nothing. A copy,
+	// the list itself changes on the updateDevices() thread.
+	static std::vector<PS3EYERef> getDevices( bool forceRefresh = false );
+	// Bandwidth admission in init(). Cameras count against the budget of
+	// their bus from init() until they are destroyed.
+	static void setBandwidthPolicy(BandwidthPolicy policy) { bandwidthPolicy = policy; }
+	static BandwidthPolicy getBandwidthPolicy() { return bandwidthPolicy; }
+	// bytes per second available on a bus, bus -1 sets the default for all
+	static void setBusBandwidth(double bytesPerSecond, int bus = -1);
+	static double getBusBandwidth(uint8_t bus);
+	// bytes per second reserved by the initialized cameras on a bus
+	static double getBusBandwidthUsed(uint8_t bus);
+	// bytes per second of this camera's mode, 0 before init()
+	double getBandwidth() const;
+	const BandwidthDecision& getBandwidthDecision() const { return bandwidth_decision; }
+
+	// camera plugged into the given socket (see getPortPath()), NULL if none
+	static PS3EYERef getDeviceByPortPath( const std::string& portPath );
+	// handle USB events, hotplug notifications and the stream watchdog
 	static bool updateDevices();
 
+	// called from getDevices()/updateDevices() when a camera arrives or leaves
+	typedef void (*HotplugCallback)(void *userData, PS3EYERef camera, bool arrived);
+	static void setHotplugCallback(HotplugCallback callback, void *userData);
+
 private:
+	friend class USBMgr;
+
 	PS3EYECam(const PS3EYECam&);
     void operator=(const PS3EYECam&);
 
 	void release();
+	bool init_sensor(uint8_t desiredFrameRate);
+	bool plan_bandwidth();
+	bool fit_frame_rate(double available, double min_rate);
+	void set_frame_size(uint32_t width, uint32_t height, uint32_t y);
+	void start_sensor(bool enable_stream = true);
 
 	// usb ops
-	uint8_t ov534_set_frame_rate(uint8_t frame_rate, bool dry_run = false);
+	double ov534_set_frame_rate(double frame_rate, bool dry_run = false);
 	void ov534_set_led(int status);
+	void ov534_set_bridge_frame();
+	void ov534_set_window();
 	void ov534_reg_write(uint16_t reg, uint8_t val);
 	uint8_t ov534_reg_read(uint16_t reg);
 	int sccb_check_status();
@@ -183,6 +427,31 @@ private:
 	uint8_t sccb_reg_read(uint16_t reg);
 	void reg_w_array(const uint8_t (*data)[2], int len);
 	void sccb_w_array(const uint8_t (*data)[2], int len);
+	void write_gain(uint8_t val) {
+	    switch(val & 0x30){
+		case 0x00:
+		    val &=0x0F;
+		    break;
+		case 0x10:
+		    val &=0x0F;
+		    val |=0x30;
+		    break;
+		case 0x20:
+		    val &=0x0F;
+		    val |=0x70;
+		    break;
+		case 0x30:
+		    val &=0x0F;
+		    val |=0xF0;
+		    break;
+	    }
+	    sccb_reg_write(0x00, val);
+	}
+	void write_exposure(uint8_t val);
+	CaptureSettings capture_settings() const;
+	// queue the current settings for the frames they will apply to
+	void settings_written();
+	void write_bracket();
 
 	// controls
 	bool autogain;
@@ -205,13 +474,40 @@ private:
 
 	static bool devicesEnumerated;
     static std::vector<PS3EYERef> devices;
+	static HotplugCallback hotplugCallback;
+	static void *hotplugUserData;
+	static BandwidthPolicy bandwidthPolicy;
+	// device list maintenance, used by the USB manager
+	static void device_arrived(libusb_device *dev);
+	static void device_left(libusb_device *dev);
+	static void device_removed(PS3EYERef cam);
+
+	bool connected;
+	std::string port_path;
 
 	uint32_t frame_width;
 	uint32_t frame_height;
 	uint32_t frame_stride;
+	uint32_t frame_x;
+	uint32_t frame_y;
+	bool frame_roi;
+	FrameFormat frame_format;
+	uint32_t row_bytes;
+	BayerOutput bayer_output;
+	DemosaicMethod bayer_method;
+	uint8_t *bayer_buf;
 	uint8_t frame_rate;
+	double frame_rate_target;
+	double frame_rate_exact;
+	double line_period;			// seconds per sensor line including dummy pixels
+	uint16_t dummy_lines;		// of the current timing
+	uint32_t delay_frame;		// frame count when the delay lines were written
+	bool delay_written;			// by check_delay(), updateDevices() thread only
+	bool stream_on;
+	BandwidthDecision bandwidth_decision;
 
 	double last_qued_frame_time;
+	FrameInfo last_frame_info;
 
 	//usb stuff
 	libusb_device *device_;
@@ -220,6 +516,23 @@ private:
 
 	std::shared_ptr<class URBDesc> urb;
 
+	uint32_t transfer_size;
+	uint32_t bulk_transfer_size() const;
+
+	std::vector<BracketStep> bracket_request;	// as set, app side
+	std::vector<BracketStep> bracket_steps;		// in use by updateDevices()
+	uint32_t bracket_pos;		// next step to write
+	uint32_t bracket_frame;		// frame count at the last write
+	bool bracket_written;
+	uint32_t control_latency;
+
+	bool watchdog;
+	uint32_t watchdog_failures;
+	double watchdog_time;
+	uint32_t recovery_count;
+	void check_stream();
+	void check_delay();
+
 	bool open_usb();
 	void close_usb();
 
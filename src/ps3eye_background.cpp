@@ -0,0 +1,309 @@
+#include "ps3eye_background.h"
+#include "ps3eye_simd.h"
+#include "ps3eye_parallel.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace ps3eye {
+
+#define MEAN_SHIFT	7		// fractional bits of the mean
+#define DEV_SHIFT	5		// mean units to the deviation units (2 fractional bits)
+#define DEV_MAX		181		// largest deviation that squares into 16 bits, 45 levels
+#define INIT_VAR	256		// 4 levels standard deviation, 4 fractional bits
+
+// dither steps between rows and samples, odd so they cover every value
+#define DITHER_ROW		0x7f4b
+#define DITHER_SAMPLE	0x9e37
+
+BackgroundModel::BackgroundModel()
+{
+	rate = 655;
+	inv_k2 = (int16_t)(65536 / (2.5 * 2.5));
+	min_diff = 8;
+	chroma = false;
+	width = height = 0;
+	freeze_w = freeze_h = 0;
+	has_model = false;
+	seed = 1;
+	dither = 0;
+	foreground = 0;
+}
+
+void BackgroundModel::setLearningRate(float alpha)
+{
+	float a = alpha * 65536 + 0.5f;
+	rate = (int16_t)(a < 1 ? 1 : (a > 32767 ? 32767 : a));
+}
+
+void BackgroundModel::setDeviations(float k)
+{
+	float inv = k > 0 ? 65536 / (k * k) + 0.5f : 32767;
+	inv_k2 = (int16_t)(inv > 32767 ? 32767 : inv);
+}
+
+void BackgroundModel::setChroma(bool enable)
+{
+	chroma = enable;
+	has_model = false;
+}
+
+void BackgroundModel::setFreezeMask(const uint8_t *m, int stride, uint32_t w, uint32_t h)
+{
+	freeze.clear();
+	freeze_w = freeze_h = 0;
+	if (m == NULL || w == 0 || h == 0) return;
+
+	freeze.resize(w * h);
+	for (uint32_t y = 0; y < h; y++)
+		memcpy(&freeze[y * w], m + y * stride, w);
+	freeze_w = w;
+	freeze_h = h;
+}
+
+void BackgroundModel::reset()
+{
+	has_model = false;
+	newest.reset();
+	foreground = 0;
+}
+
+/* One sample against its model. The increments are the exact products
+ * with the rate, rounded up with probability equal to the dropped
+ * fraction (r is uniform over 16 bits), which the vector code below does
+ * with mulhi/mullo and an unsigned compare. */
+static inline int dither_mul(int v, int a, uint16_t r)
+{
+	int p = v * a;
+	int hi = p >> 16;
+	uint16_t lo = (uint16_t)p;
+	return hi + (lo > r ? 1 : 0);
+}
+
+static inline bool model_sample(int x, int16_t &mean, int16_t &var, bool frozen, int rate,
+								int inv_k2, int min_q, uint16_t r)
+{
+	int delta = (x << MEAN_SHIFT) - mean;
+	int dq = delta >> DEV_SHIFT;
+	int adq = dq < 0 ? -dq : dq;
+	int dc = adq > DEV_MAX ? DEV_MAX : adq;
+	int d2 = dc * dc;
+	bool fg = adq > min_q && (((d2 * inv_k2) >> 16) > var || adq >= DEV_MAX);
+
+	if (!frozen) {
+		mean = (int16_t)(mean + dither_mul(delta, rate, r));
+		var = (int16_t)(var + dither_mul(d2 - var, rate, r));
+	}
+	return fg;
+}
+
+#if PS3EYE_SIMD
+
+struct lane_consts
+{
+	vec rate, inv_k2, min_q, dev_max, sign;
+	vec lane_dither;	// i * DITHER_SAMPLE in lane i
+};
+
+static inline vec dither_mul_lanes(vec v, vec a, vec r, vec sign)
+{
+	vec lo = v_mullo16(v, a);
+	// lo > r unsigned, as a signed compare with the top bits flipped
+	vec up = v_gt16(v_xor(lo, sign), v_xor(r, sign));
+	return v_sub16(v_mulhi16(v, a), up);
+}
+
+// 16 bit lanes of samples x against mean/var, returns the foreground lanes
+static inline vec model_lanes(vec x, int16_t *mean_p, int16_t *var_p, vec frozen, vec r,
+							  const lane_consts &c)
+{
+	vec mean = v_load(mean_p), var = v_load(var_p);
+	vec delta = v_sub16(v_slli16(x, MEAN_SHIFT), mean);
+	vec adq = v_abs16(v_srai16(delta, DEV_SHIFT));
+	vec dc = v_min16(adq, c.dev_max);
+	vec d2 = v_mullo16(dc, dc);
+	vec fg = v_and(v_gt16(adq, c.min_q),
+				   v_or(v_gt16(v_mulhi16(d2, c.inv_k2), var), v_gt16(adq, v_sub16(c.dev_max, v_set16(1)))));
+
+	vec dm = v_andnot(dither_mul_lanes(delta, c.rate, r, c.sign), frozen);
+	vec dv = v_andnot(dither_mul_lanes(v_sub16(d2, var), c.rate, r, c.sign), frozen);
+	v_store(mean_p, v_add16(mean, dm));
+	v_store(var_p, v_add16(var, dv));
+	return fg;
+}
+
+// a vector of byte samples at sample index x, returns 0 / 0xff foreground bytes
+static inline vec model_vec(vec x8, int16_t *mean, int16_t *var, const uint8_t *freeze,
+							uint16_t dither, const lane_consts &c)
+{
+	const int half = PS3EYE_SIMD_WIDTH / 2;
+	vec f8 = freeze ? v_load(freeze) : v_zero();
+	vec fz_lo = v_gt16(v_widen_lo(f8), v_zero()), fz_hi = v_gt16(v_widen_hi(f8), v_zero());
+	vec r_lo = v_add16(v_set16((int16_t)dither), c.lane_dither);
+	vec r_hi = v_add16(v_set16((int16_t)(dither + half * DITHER_SAMPLE)), c.lane_dither);
+
+	vec lo = model_lanes(v_widen_lo(x8), mean, var, fz_lo, r_lo, c);
+	vec hi = model_lanes(v_widen_hi(x8), mean + half, var + half, fz_hi, r_hi, c);
+	// 0xffff lanes to 0xff bytes
+	return v_pack16(v_srli16(lo, 8), v_srli16(hi, 8));
+}
+
+#endif
+
+void BackgroundModel::model_rows(const uint8_t *frame, int stride, PixelInput input, int begin, int end)
+{
+	const bool yuyv = input == INPUT_YUYV;
+	const bool use_chroma = chroma && yuyv;
+	const bool use_freeze = freeze_w == width && freeze_h == height;
+	const int min_q = min_diff << (MEAN_SHIFT - DEV_SHIFT);
+
+#if PS3EYE_SIMD
+	lane_consts c;
+	int16_t lanes[PS3EYE_SIMD_WIDTH / 2];
+	for (int i = 0; i < PS3EYE_SIMD_WIDTH / 2; i++) lanes[i] = (int16_t)(i * DITHER_SAMPLE);
+	c.rate = v_set16(rate);
+	c.inv_k2 = v_set16(inv_k2);
+	c.min_q = v_set16((int16_t)min_q);
+	c.dev_max = v_set16(DEV_MAX);
+	c.sign = v_set16((int16_t)0x8000);
+	c.lane_dither = v_load(lanes);
+	const vec low = v_set16(0x00ff);
+#endif
+
+	for (int y = begin; y < end; y++) {
+		const uint8_t *row = frame + y * stride;
+		const uint8_t *fz = use_freeze ? &freeze[y * width] : NULL;
+		int16_t *my = &mean_y[y * width], *vy = &var_y[y * width];
+		int16_t *mc = use_chroma ? &mean_c[y * width] : NULL, *vc = use_chroma ? &var_c[y * width] : NULL;
+		uint8_t *out = &mask[y * width];
+		uint16_t row_dither = (uint16_t)(dither + y * DITHER_ROW);
+		uint32_t count = 0, x = 0;
+
+#if PS3EYE_SIMD
+		for (; x + PS3EYE_SIMD_WIDTH <= width; x += PS3EYE_SIMD_WIDTH) {
+			uint16_t r = (uint16_t)(row_dither + x * DITHER_SAMPLE);
+			vec a = v_zero(), b = v_zero(), y8;
+			if (yuyv) {
+				a = v_load(row + 2 * x);
+				b = v_load(row + 2 * x + PS3EYE_SIMD_WIDTH);
+				y8 = v_pack16(v_and(a, low), v_and(b, low));
+			} else {
+				y8 = v_load(row + x);
+			}
+			vec fg = model_vec(y8, my + x, vy + x, fz ? fz + x : NULL, r, c);
+			if (use_chroma) {
+				vec uv = v_pack16(v_srli16(a, 8), v_srli16(b, 8));
+				vec fc = model_vec(uv, mc + x, vc + x, fz ? fz + x : NULL, r, c);
+				// U and V of a macropixel share a 16 bit lane
+				fg = v_or(fg, v_or(fc, v_or(v_slli16(fc, 8), v_srli16(fc, 8))));
+			}
+			v_store(out + x, fg);
+			uint32_t bits = v_movemask8(fg);
+			while (bits) { bits &= bits - 1; count++; }
+		}
+#endif
+
+		// a macropixel at a time with chroma, its U and V decide both pixels
+		for (uint32_t step = use_chroma ? 2 : 1; x < width; x += step) {
+			uint32_t n = (std::min)(step, width - x);
+			bool fg[2] = { false, false }, fc = false;
+			for (uint32_t i = 0; i < n; i++) {
+				uint32_t xi = x + i;
+				uint16_t r = (uint16_t)(row_dither + xi * DITHER_SAMPLE);
+				bool frozen = fz && fz[xi];
+				fg[i] = model_sample(yuyv ? row[2 * xi] : row[xi], my[xi], vy[xi], frozen,
+									 rate, inv_k2, min_q, r);
+				if (use_chroma)
+					fc = model_sample(row[2 * xi + 1], mc[xi], vc[xi], frozen,
+									  rate, inv_k2, min_q, r) || fc;
+			}
+			for (uint32_t i = 0; i < n; i++) {
+				out[x + i] = fg[i] || fc ? 0xff : 0;
+				if (out[x + i]) count++;
+			}
+		}
+		row_counts[y] = count;
+	}
+}
+
+uint32_t BackgroundModel::process(const uint8_t *frame, int stride, uint32_t w, uint32_t h,
+								  PixelInput input)
+{
+	if (w == 0 || h == 0) return 0;
+
+	if (w != width || h != height) {
+		width = w;
+		height = h;
+		has_model = false;
+	}
+
+	if (!has_model) {
+		// the first frame is the background
+		mean_y.resize(w * h);
+		var_y.assign(w * h, INIT_VAR);
+		mean_c.clear();
+		var_c.clear();
+		if (chroma && input == INPUT_YUYV) {
+			mean_c.resize(w * h);
+			var_c.assign(w * h, INIT_VAR);
+		}
+		for (uint32_t y = 0; y < h; y++) {
+			const uint8_t *row = frame + y * stride;
+			for (uint32_t x = 0; x < w; x++) {
+				if (input == INPUT_YUYV) {
+					mean_y[y * w + x] = (int16_t)(row[2 * x] << MEAN_SHIFT);
+					if (!mean_c.empty()) mean_c[y * w + x] = (int16_t)(row[2 * x + 1] << MEAN_SHIFT);
+				} else {
+					mean_y[y * w + x] = (int16_t)(row[x] << MEAN_SHIFT);
+				}
+			}
+		}
+		mask.assign(w * h, 0);
+		row_counts.assign(h, 0);
+		foreground = 0;
+		has_model = true;
+		return 0;
+	}
+
+	// a frame with chroma after a model without it
+	if (chroma && input == INPUT_YUYV && mean_c.empty()) {
+		has_model = false;
+		return process(frame, stride, w, h, input);
+	}
+
+	seed = seed * 1103515245 + 12345;
+	dither = seed >> 16;
+
+	parallel_rows(height, 16, [=](int begin, int end) {
+		model_rows(frame, stride, input, begin, end);
+	});
+
+	foreground = 0;
+	for (uint32_t y = 0; y < height; y++) foreground += row_counts[y];
+	return foreground;
+}
+
+bool BackgroundModel::update(const PS3EYECam &cam)
+{
+	const uint8_t *frame = newest.next(cam);
+	if (frame == NULL) return false;
+
+	PixelInput input = pixelInput(cam.getFormat());
+	process(frame, cam.getWidth() * inputBytes(input), cam.getWidth(), cam.getHeight(), input);
+	return true;
+}
+
+void BackgroundModel::getBackground(uint8_t *dst, int stride) const
+{
+	const int round = 1 << (MEAN_SHIFT - 1);
+
+	for (uint32_t y = 0; y < height; y++, dst += stride) {
+		const int16_t *m = &mean_y[y * width];
+		for (uint32_t x = 0; x < width; x++) {
+			int v = (m[x] + round) >> MEAN_SHIFT;
+			dst[x] = (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+		}
+	}
+}
+
+} // namespace
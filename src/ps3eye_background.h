@@ -0,0 +1,82 @@
+#ifndef PS3EYE_BACKGROUND_H
+#define PS3EYE_BACKGROUND_H
+
+#include "ps3eye_input.h"
+
+#include <vector>
+
+namespace ps3eye {
+
+/* Per pixel running average and variance background model. Every frame
+ * a pixel is foreground when it is more than k standard deviations and
+ * the minimum difference away from the mean, then mean and variance move
+ * towards the new value by the learning rate.
+ *
+ * The model is 16 bit fixed point: the mean has 7 fractional bits, the
+ * variance 4, and the deviation used for the variance is clamped to 45
+ * levels (larger differences are always foreground). Updates round up or
+ * down at random in proportion to the lost fraction, so slow learning
+ * rates still converge to the exact average instead of stalling a few
+ * levels off.
+ *
+ * Pixels under the freeze mask keep their model, so a region can be
+ * masked out while something stands in it. */
+class BackgroundModel
+{
+public:
+	BackgroundModel();
+
+	// fraction of the difference learned per frame, 1/65536 .. 0.5, default 0.01
+	void setLearningRate(float alpha);
+	// foreground beyond this many standard deviations, at least 1.5, default 2.5
+	void setDeviations(float k);
+	// and at least this many levels from the mean, default 8
+	void setMinDifference(uint8_t levels) { min_diff = levels; }
+	// also model U and V of YUYV frames, a pixel is then foreground if
+	// its luma or the chroma of its macropixel is. Restarts the model.
+	void setChroma(bool enable);
+	// non zero bytes freeze learning, a width x height mask copied here,
+	// NULL to clear; ignored while it does not match the frame size
+	void setFreezeMask(const uint8_t *mask, int stride, uint32_t width, uint32_t height);
+	// start over with the next frame
+	void reset();
+
+	// classify a frame and learn from it, returns the foreground pixels
+	uint32_t process(const uint8_t *frame, int stride, uint32_t width, uint32_t height,
+					 PixelInput input = INPUT_YUYV);
+	// process the newest frame of the camera if it was not processed yet,
+	// false if there was none
+	bool update(const PS3EYECam &cam);
+	// sequence of the frame last processed by update()
+	uint32_t getSequence() const { return newest.getSequence(); }
+
+	// 0 / 255 foreground bytes of the last frame, width bytes per row
+	const uint8_t* getMask() const { return mask.empty() ? NULL : &mask[0]; }
+	uint32_t getForegroundPixels() const { return foreground; }
+	// the luma mean as a Y8 image
+	void getBackground(uint8_t *dst, int stride) const;
+
+private:
+	void model_rows(const uint8_t *frame, int stride, PixelInput input, int begin, int end);
+
+	int16_t rate;		// learning rate, 1/65536 units
+	int16_t inv_k2;		// 1/k^2, 1/65536 units
+	uint8_t min_diff;
+	bool chroma;
+
+	uint32_t width, height;
+	std::vector<int16_t> mean_y, var_y;
+	std::vector<int16_t> mean_c, var_c;	// U/V samples in YUYV order
+	std::vector<uint8_t> freeze;
+	uint32_t freeze_w, freeze_h;
+	std::vector<uint8_t> mask;
+	std::vector<uint32_t> row_counts;
+	bool has_model;
+	uint32_t seed, dither;
+	uint32_t foreground;
+	NewestFrame newest;
+};
+
+} // namespace
+
+#endif
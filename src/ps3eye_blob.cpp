@@ -0,0 +1,265 @@
+#include "ps3eye_blob.h"
+#include "ps3eye_simd.h"
+
+#include <algorithm>
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+
+namespace ps3eye {
+
+#define NO_LABEL 0xffffffffu
+
+static inline uint32_t ctz32(uint32_t v)
+{
+#if defined(_MSC_VER)
+	unsigned long i;
+	_BitScanForward(&i, v);
+	return (uint32_t)i;
+#else
+	return (uint32_t)__builtin_ctz(v);
+#endif
+}
+
+BlobDetector::BlobDetector()
+{
+	input_type = INPUT_YUYV;
+	thresh_lo = 200;
+	thresh_hi = 255;
+	mask_bits = 0xff;
+	min_area = 1;
+	max_blobs = 0;
+	width = height = next_row = 0;
+	frame_stride = 0;
+	callback = NULL;
+	callback_data = NULL;
+}
+
+void BlobDetector::begin(uint32_t w, uint32_t h)
+{
+	width = w;
+	height = h;
+	next_row = 0;
+	prev.clear();
+	cur.clear();
+	labels.clear();
+}
+
+/* Set pixels of a row as a bit string, 32 pixels per word. SIMD lanes
+ * compare a vector of pixels at a time and movemask them into the words. */
+static void threshold_row(const uint8_t *row, uint32_t width, PixelInput input,
+						  uint8_t lo, uint8_t hi, uint8_t bits_mask, uint32_t *bits)
+{
+	uint32_t x = 0;
+
+	for (uint32_t i = 0; i < (width + 31) / 32; i++) bits[i] = 0;
+
+#if PS3EYE_SIMD
+	const vec vlo = v_set8(lo), vhi = v_set8(hi), vbits = v_set8(bits_mask);
+	const vec luma = v_set16(0x00ff);
+
+	for (; x + PS3EYE_SIMD_WIDTH <= width; x += PS3EYE_SIMD_WIDTH) {
+		vec v, on;
+		if (input == INPUT_YUYV) {
+			vec a = v_load(row + 2 * x), b = v_load(row + 2 * x + PS3EYE_SIMD_WIDTH);
+			v = v_pack16(v_and(a, luma), v_and(b, luma));
+		} else {
+			v = v_load(row + x);
+		}
+		if (input == INPUT_MASK)
+			on = v_xor(v_eq8(v_and(v, vbits), v_zero()), v_set8(0xff));
+		else
+			on = v_and(v_eq8(v_max8(v, vlo), v), v_eq8(v_min8(v, vhi), v));
+		// x is a multiple of the vector width, so a vector never straddles words
+		bits[x >> 5] |= v_movemask8(on) << (x & 31);
+	}
+#endif
+
+	for (; x < width; x++) {
+		uint8_t v = input == INPUT_YUYV ? row[2 * x] : row[x];
+		bool on = input == INPUT_MASK ? (v & bits_mask) != 0 : (v >= lo && v <= hi);
+		if (on) bits[x >> 5] |= 1u << (x & 31);
+	}
+}
+
+// run length encode the set pixels of a row into cur
+void BlobDetector::encode_row(const uint8_t *row)
+{
+	uint32_t words = (width + 31) / 32;
+	uint32_t *bits;
+	uint32_t start = 0;
+	bool in_run = false;
+
+	row_bits.resize(words);
+	bits = &row_bits[0];
+	threshold_row(row, width, input_type, thresh_lo, thresh_hi, mask_bits, bits);
+
+	cur.clear();
+	for (uint32_t i = 0; i < words; i++) {
+		uint32_t w = bits[i], pos = 0;
+
+		if (w == (in_run ? 0xffffffffu : 0)) continue;
+		// find the transitions, each search is for the opposite state
+		for (;;) {
+			uint32_t v = (in_run ? ~w : w) & (pos < 32 ? ~0u << pos : 0);
+			if (v == 0) break;
+			pos = ctz32(v);
+			if (in_run) {
+				Run r = { (uint16_t)start, (uint16_t)(i * 32 + pos), NO_LABEL };
+				cur.push_back(r);
+			} else {
+				start = i * 32 + pos;
+			}
+			in_run = !in_run;
+		}
+	}
+	if (in_run) {
+		Run r = { (uint16_t)start, (uint16_t)width, NO_LABEL };
+		cur.push_back(r);
+	}
+}
+
+uint32_t BlobDetector::find(uint32_t label)
+{
+	uint32_t root = label;
+	while (labels[root].parent != root) root = labels[root].parent;
+	while (labels[label].parent != root) {
+		uint32_t next = labels[label].parent;
+		labels[label].parent = root;
+		label = next;
+	}
+	return root;
+}
+
+// merge the component of b into a, both roots
+void BlobDetector::join(uint32_t a, uint32_t b)
+{
+	Label &la = labels[a], &lb = labels[b];
+	lb.parent = a;
+	la.area += lb.area;
+	la.sum_x += lb.sum_x;
+	la.sum_y += lb.sum_y;
+	la.left = (std::min)(la.left, lb.left);
+	la.top = (std::min)(la.top, lb.top);
+	la.right = (std::max)(la.right, lb.right);
+	la.bottom = (std::max)(la.bottom, lb.bottom);
+}
+
+// label the runs of cur from the touching runs of prev (row y - 1)
+void BlobDetector::link_row(uint32_t y)
+{
+	size_t j = 0;
+
+	for (size_t i = 0; i < cur.size(); i++) {
+		Run &r = cur[i];
+		uint32_t label = NO_LABEL;
+
+		// 8 neighbours: prev touches r if [x0, x1) overlaps [r.x0 - 1, r.x1 + 1)
+		while (j < prev.size() && prev[j].x1 < r.x0) j++;
+		for (size_t k = j; k < prev.size() && prev[k].x0 <= r.x1; k++) {
+			uint32_t l = find(prev[k].label);
+			if (label == NO_LABEL) {
+				label = l;
+			} else if (l != label) {
+				join(label, l);
+			}
+		}
+
+		if (label == NO_LABEL) {
+			Label l;
+			l.parent = label = (uint32_t)labels.size();
+			l.area = 0;
+			l.sum_x = l.sum_y = 0;
+			l.left = r.x0;
+			l.right = r.x1 - 1;
+			l.top = l.bottom = (uint16_t)y;
+			labels.push_back(l);
+		}
+
+		Label &l = labels[label];
+		uint32_t len = r.x1 - r.x0;
+		l.area += len;
+		l.sum_x += (uint64_t)(r.x0 + r.x1 - 1) * len / 2;
+		l.sum_y += (uint64_t)y * len;
+		l.left = (std::min)(l.left, r.x0);
+		l.right = (std::max)(l.right, (uint16_t)(r.x1 - 1));
+		l.bottom = (uint16_t)y;
+		r.label = label;
+	}
+}
+
+void BlobDetector::addRows(const uint8_t *rows, int stride, uint32_t rowBegin, uint32_t rowEnd)
+{
+	for (uint32_t y = rowBegin; y < rowEnd && y < height; y++, rows += stride) {
+		// a gap in the rows breaks the connection to the row above
+		if (y != next_row) prev.clear();
+		encode_row(rows);
+		link_row(y);
+		prev.swap(cur);
+		next_row = y + 1;
+	}
+}
+
+static bool larger(const Blob &a, const Blob &b)
+{
+	return a.area > b.area;
+}
+
+const std::vector<Blob>& BlobDetector::end()
+{
+	blobs.clear();
+	for (uint32_t i = 0; i < labels.size(); i++) {
+		const Label &l = labels[i];
+		if (l.parent != i || l.area < min_area) continue;
+
+		Blob b;
+		b.area = l.area;
+		b.x = (float)((double)l.sum_x / l.area);
+		b.y = (float)((double)l.sum_y / l.area);
+		b.left = l.left;
+		b.top = l.top;
+		b.right = l.right;
+		b.bottom = l.bottom;
+		blobs.push_back(b);
+	}
+	std::sort(blobs.begin(), blobs.end(), larger);
+	if (max_blobs && blobs.size() > max_blobs) blobs.resize(max_blobs);
+
+	prev.clear();
+	next_row = 0;
+	return blobs;
+}
+
+const std::vector<Blob>& BlobDetector::detect(const uint8_t *image, int stride, uint32_t w, uint32_t h)
+{
+	begin(w, h);
+	addRows(image, stride, 0, h);
+	return end();
+}
+
+void BlobDetector::attach(PS3EYECam &cam, BlobCallback cb, void *userData, uint32_t sliceRows)
+{
+	input_type = pixelInput(cam.getFormat());
+	width = cam.getWidth();
+	height = cam.getHeight();
+	frame_stride = width * inputBytes(input_type);
+	callback = cb;
+	callback_data = userData;
+	cam.setSliceCallback(sliceRows, &BlobDetector::onSlice, this);
+}
+
+void BlobDetector::onSlice(void *detector, const uint8_t *frame, uint32_t sequence,
+						   uint32_t rowBegin, uint32_t rowEnd)
+{
+	BlobDetector *d = static_cast<BlobDetector*>(detector);
+
+	if (rowBegin == 0) d->begin(d->width, d->height);
+	d->addRows(frame + rowBegin * d->frame_stride, d->frame_stride, rowBegin, rowEnd);
+	if (rowEnd >= d->height) {
+		d->end();
+		if (d->callback) d->callback(d->callback_data, sequence, d->blobs);
+	}
+}
+
+} // namespace
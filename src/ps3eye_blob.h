@@ -0,0 +1,100 @@
+#ifndef PS3EYE_BLOB_H
+#define PS3EYE_BLOB_H
+
+#include "ps3eye_input.h"
+
+#include <vector>
+
+namespace ps3eye {
+
+struct Blob
+{
+	uint32_t area;			// pixels
+	float x, y;				// centroid
+	uint16_t left, top;		// bounding box, inclusive
+	uint16_t right, bottom;
+};
+
+/* Connected components (8 neighbours) of a thresholded image, built row
+ * by row: each row is run length encoded and its runs are joined to the
+ * overlapping runs of the row above with a union-find over the component
+ * labels, so rows can be fed as they arrive and only the final
+ * collection of components is left when the last row is in.
+ *
+ *	detector.begin(640, 480);
+ *	detector.addRows(rows, stride, 0, 16);	// any number of bands
+ *	...
+ *	const std::vector<Blob>& blobs = detector.end();
+ *
+ * attach() does this from a camera's row slices. */
+class BlobDetector
+{
+public:
+	typedef void (*BlobCallback)(void *userData, uint32_t sequence, const std::vector<Blob> &blobs);
+
+	BlobDetector();
+
+	void setInput(PixelInput input) { input_type = input; }
+	// pixels with lo <= value <= hi are set
+	void setThreshold(uint8_t lo, uint8_t hi = 255) { thresh_lo = lo; thresh_hi = hi; }
+	// with INPUT_MASK pixels having any of these bits are set
+	void setMaskBits(uint8_t bits) { mask_bits = bits; }
+	// smaller components are not reported
+	void setMinArea(uint32_t pixels) { min_area = pixels; }
+	// at most this many blobs are reported, largest first, 0 for all
+	void setMaxBlobs(uint32_t count) { max_blobs = count; }
+
+	void begin(uint32_t width, uint32_t height);
+	// rows [rowBegin, rowEnd), rows points to rowBegin; rows must come in order
+	void addRows(const uint8_t *rows, int stride, uint32_t rowBegin, uint32_t rowEnd);
+	// components of the rows added since begin(), largest first
+	const std::vector<Blob>& end();
+
+	const std::vector<Blob>& detect(const uint8_t *image, int stride, uint32_t width, uint32_t height);
+	const std::vector<Blob>& getBlobs() const { return blobs; }
+
+	// Detect on the camera's row slices (see PS3EYECam::setSliceCallback)
+	// and report each frame from the USB event thread. YUYV frames are
+	// thresholded on luma, Bayer frames on the raw values.
+	void attach(PS3EYECam &cam, BlobCallback callback, void *userData, uint32_t sliceRows = 16);
+	static void onSlice(void *detector, const uint8_t *frame, uint32_t sequence,
+						uint32_t rowBegin, uint32_t rowEnd);
+
+private:
+	struct Run
+	{
+		uint16_t x0, x1;	// [x0, x1)
+		uint32_t label;
+	};
+	struct Label
+	{
+		uint32_t parent;
+		uint32_t area;
+		uint64_t sum_x, sum_y;
+		uint16_t left, top, right, bottom;
+	};
+
+	void encode_row(const uint8_t *row);
+	void link_row(uint32_t y);
+	uint32_t find(uint32_t label);
+	void join(uint32_t a, uint32_t b);
+
+	PixelInput input_type;
+	uint8_t thresh_lo, thresh_hi, mask_bits;
+	uint32_t min_area, max_blobs;
+
+	uint32_t width, height, next_row;
+	std::vector<uint32_t> row_bits;
+	std::vector<Run> prev, cur;
+	std::vector<Label> labels;
+	std::vector<Blob> blobs;
+
+	// attach() state
+	int frame_stride;
+	BlobCallback callback;
+	void *callback_data;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,129 @@
+#include "ps3eye_clock.h"
+
+#include <cmath>
+#include <algorithm>
+
+namespace ps3eye {
+
+#define CLOCK_FORGET		0.995	/* per frame, about 200 frames of memory */
+#define CLOCK_MIN_SAMPLES	16
+#define CLOCK_REJECT_SIGMA	3.0
+#define CLOCK_MIN_JITTER	0.0005	/* never reject closer than this, seconds */
+#define CLOCK_MAX_REJECT	30		/* this many late frames in a row is a clock step */
+#define CLOCK_MAX_ERROR		0.1		/* early by more than this is a clock step too */
+
+ClockModel::ClockModel()
+{
+	reset();
+}
+
+void ClockModel::reset()
+{
+	last_pts = 0;
+	last_host = 0;
+	sw = sx = sy = sxx = sxy = syy = 0;
+	samples = 0;
+	rejected = 0;
+}
+
+// move the origin of the sums to (dx, dy)
+void ClockModel::rebase(double dx, double dy)
+{
+	sxx += sw * dx * dx - 2 * dx * sx;
+	sxy += sw * dx * dy - dx * sy - dy * sx;
+	syy += sw * dy * dy - 2 * dy * sy;
+	sx -= sw * dx;
+	sy -= sw * dy;
+}
+
+double ClockModel::predict(double x) const
+{
+	if (sw <= 0) return 0;
+
+	double mx = sx / sw, my = sy / sw;
+	double vx = sxx / sw - mx * mx;
+	if (vx <= 0) return my;
+	return my + (sxy / sw - mx * my) / vx * (x - mx);
+}
+
+double ClockModel::update(uint32_t pts, double host_time)
+{
+	if (samples > 0 && (int32_t)(pts - last_pts) <= 0) {
+		// PTS went back, the stream was restarted
+		reset();
+	}
+	if (samples == 0) {
+		last_pts = pts;
+		last_host = host_time;
+		sw = 1;
+		samples = 1;
+		return host_time;
+	}
+
+	rebase((double)(uint32_t)(pts - last_pts), host_time - last_host);
+	last_pts = pts;
+	last_host = host_time;
+
+	// the new sample sits at the origin, its residual is minus the fit
+	double r = -predict(0);
+	bool valid = isValid();
+
+	if (valid && (r > (std::max)(CLOCK_REJECT_SIGMA * getJitter(), CLOCK_MIN_JITTER) ||
+				  r < -CLOCK_MAX_ERROR)) {
+		if (++rejected < CLOCK_MAX_REJECT && r > 0)
+			return last_host + predict(0);
+		// the clocks jumped, start over from here
+		reset();
+		last_pts = pts;
+		last_host = host_time;
+		sw = 1;
+		samples = 1;
+		return host_time;
+	}
+	rejected = 0;
+
+	sw = sw * CLOCK_FORGET + 1;
+	sx *= CLOCK_FORGET;
+	sy *= CLOCK_FORGET;
+	sxx *= CLOCK_FORGET;
+	sxy *= CLOCK_FORGET;
+	syy *= CLOCK_FORGET;
+	samples++;
+
+	return isValid() ? last_host + predict(0) : host_time;
+}
+
+bool ClockModel::isValid() const
+{
+	return samples >= CLOCK_MIN_SAMPLES && getTicksPerSecond() > 0;
+}
+
+double ClockModel::toHost(uint32_t pts) const
+{
+	return last_host + predict((double)(int32_t)(pts - last_pts));
+}
+
+double ClockModel::getTicksPerSecond() const
+{
+	if (samples < 2) return 0;
+
+	double mx = sx / sw, my = sy / sw;
+	double cov = sxy / sw - mx * my;
+	double vx = sxx / sw - mx * mx;
+	if (cov <= 0 || vx <= 0) return 0;
+	return vx / cov;
+}
+
+double ClockModel::getJitter() const
+{
+	if (sw <= 0) return 0;
+
+	double mx = sx / sw, my = sy / sw;
+	double cov = sxy / sw - mx * my;
+	double vx = sxx / sw - mx * mx;
+	double vy = syy / sw - my * my;
+	double res = vx > 0 ? vy - cov * cov / vx : vy;
+	return res > 0 ? std::sqrt(res) : 0;
+}
+
+} // namespace
@@ -0,0 +1,47 @@
+#ifndef PS3EYE_CLOCK_H
+#define PS3EYE_CLOCK_H
+
+#include <stdint.h>
+
+namespace ps3eye {
+
+/* Maps the 32 bit payload PTS of a camera to host time. Every completed
+ * frame adds a (PTS, host arrival) pair to an exponentially weighted
+ * linear regression, so the fit follows the drift between the two
+ * clocks. Arrival times are only ever late, so samples far above the fit
+ * are left out. The mapped time is the frame completion time on the host
+ * clock with the USB and scheduling jitter removed. */
+class ClockModel
+{
+public:
+	ClockModel();
+
+	void reset();
+	// add a frame, returns its mapped host time (host_time until valid)
+	double update(uint32_t pts, double host_time);
+
+	// enough samples for the fit to be used
+	bool isValid() const;
+	// host time of a PTS near the latest one, host seconds
+	double toHost(uint32_t pts) const;
+	// estimated device clock rate, 0 until valid
+	double getTicksPerSecond() const;
+	// deviation of accepted arrival times from the fit, seconds
+	double getJitter() const;
+	uint32_t getSamples() const { return samples; }
+
+private:
+	void rebase(double dx, double dy);
+	double predict(double x) const;
+
+	uint32_t last_pts;
+	double last_host;		// host time of the reference point
+	// weighted sums relative to the reference point (latest sample)
+	double sw, sx, sy, sxx, sxy, syy;
+	uint32_t samples;
+	uint32_t rejected;		// consecutive rejections
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,193 @@
+#include "ps3eye_color.h"
+#include "ps3eye_simd.h"
+#include "ps3eye_parallel.h"
+
+#include <algorithm>
+
+namespace ps3eye {
+
+#define MAX_SIMD_BOXES	16
+#define TABLE_SIZE		(64 * 64 * 64)
+
+static inline int table_index(int y, int u, int v)
+{
+	return ((y >> 2) << 12) | ((u >> 2) << 6) | (v >> 2);
+}
+
+ColorClassifier::ColorClassifier()
+{
+	use_table = false;
+}
+
+void ColorClassifier::clear()
+{
+	boxes.clear();
+	table.clear();
+	use_table = false;
+}
+
+bool ColorClassifier::addYUVBox(int c, uint8_t ymin, uint8_t ymax, uint8_t umin, uint8_t umax,
+								uint8_t vmin, uint8_t vmax)
+{
+	if (c < 0 || c >= COLOR_MAX_CLASSES || ymin > ymax || umin > umax || vmin > vmax)
+		return false;
+
+	Box b = { { ymin, umin, vmin }, { ymax, umax, vmax }, (uint8_t)(1 << c) };
+	boxes.push_back(b);
+
+	// the table keeps every cell the box touches
+	if (table.empty()) table.assign(TABLE_SIZE, 0);
+	for (int y = ymin >> 2; y <= ymax >> 2; y++)
+		for (int u = umin >> 2; u <= umax >> 2; u++)
+			for (int v = vmin >> 2; v <= vmax >> 2; v++)
+				table[(y << 12) | (u << 6) | v] |= b.bit;
+
+	use_table = use_table || boxes.size() > MAX_SIMD_BOXES;
+	return true;
+}
+
+// BT.601 video range, as the camera delivers it
+static void yuv_to_hsv(float y, float u, float v, float &h, float &s, float &val)
+{
+	float c = 1.164f * (y - 16);
+	float r = c + 1.596f * (v - 128);
+	float g = c - 0.813f * (v - 128) - 0.391f * (u - 128);
+	float b = c + 2.018f * (u - 128);
+	r = (std::min)(255.0f, (std::max)(0.0f, r)) / 255;
+	g = (std::min)(255.0f, (std::max)(0.0f, g)) / 255;
+	b = (std::min)(255.0f, (std::max)(0.0f, b)) / 255;
+
+	float mx = (std::max)(r, (std::max)(g, b));
+	float mn = (std::min)(r, (std::min)(g, b));
+	float d = mx - mn;
+
+	val = mx;
+	s = mx > 0 ? d / mx : 0;
+	if (d <= 0)
+		h = 0;
+	else if (mx == r)
+		h = 60 * (g - b) / d;
+	else if (mx == g)
+		h = 60 * (b - r) / d + 120;
+	else
+		h = 60 * (r - g) / d + 240;
+	if (h < 0) h += 360;
+}
+
+bool ColorClassifier::addHSVRange(int c, float hmin, float hmax, float smin, float smax,
+								  float vmin, float vmax)
+{
+	if (c < 0 || c >= COLOR_MAX_CLASSES || smin > smax || vmin > vmax)
+		return false;
+
+	uint8_t bit = (uint8_t)(1 << c);
+	if (table.empty()) table.assign(TABLE_SIZE, 0);
+
+	// classify the center of every cell
+	for (int i = 0; i < TABLE_SIZE; i++) {
+		float h, s, v;
+		yuv_to_hsv((float)((i >> 12) * 4 + 2), (float)(((i >> 6) & 63) * 4 + 2),
+				   (float)((i & 63) * 4 + 2), h, s, v);
+		bool hue = hmin <= hmax ? (h >= hmin && h <= hmax) : (h >= hmin || h <= hmax);
+		if (hue && s >= smin && s <= smax && v >= vmin && v <= vmax)
+			table[i] |= bit;
+	}
+
+	use_table = true;
+	return true;
+}
+
+uint8_t ColorClassifier::classify(uint8_t y, uint8_t u, uint8_t v) const
+{
+	if (use_table) return table[table_index(y, u, v)];
+
+	uint8_t mask = 0;
+	for (size_t i = 0; i < boxes.size(); i++) {
+		const Box &b = boxes[i];
+		if (y >= b.lo[0] && y <= b.hi[0] && u >= b.lo[1] && u <= b.hi[1] &&
+			v >= b.lo[2] && v <= b.hi[2])
+			mask |= b.bit;
+	}
+	return mask;
+}
+
+void ColorClassifier::classify_row(const uint8_t *src, uint8_t *dst, int width) const
+{
+	int x = 0;
+
+	if (use_table) {
+		const uint8_t *t = &table[0];
+		for (; x + 1 < width; x += 2, src += 4) {
+			int uv = ((src[1] >> 2) << 6) | (src[3] >> 2);
+			dst[x] = t[((src[0] >> 2) << 12) | uv];
+			dst[x + 1] = t[((src[2] >> 2) << 12) | uv];
+		}
+		if (x < width) dst[x] = t[table_index(src[0], src[1], src[3])];
+		return;
+	}
+
+#if PS3EYE_SIMD
+	const vec low = v_set16(0x00ff), high = v_set16((int16_t)0xff00);
+
+	for (; x + PS3EYE_SIMD_WIDTH <= width; x += PS3EYE_SIMD_WIDTH, src += 2 * PS3EYE_SIMD_WIDTH) {
+		vec a = v_load(src), b = v_load(src + PS3EYE_SIMD_WIDTH);
+		vec y = v_pack16(v_and(a, low), v_and(b, low));
+		// U0 V0 U1 V1 ..., then each byte repeated for the two pixels
+		vec uv = v_pack16(v_srli16(a, 8), v_srli16(b, 8));
+		vec u = v_or(v_and(uv, low), v_slli16(uv, 8));
+		vec v = v_or(v_srli16(uv, 8), v_and(uv, high));
+		vec mask = v_zero();
+
+		for (size_t i = 0; i < boxes.size(); i++) {
+			const Box &bx = boxes[i];
+			vec in = v_and(v_eq8(v_max8(y, v_set8(bx.lo[0])), y), v_eq8(v_min8(y, v_set8(bx.hi[0])), y));
+			in = v_and(in, v_and(v_eq8(v_max8(u, v_set8(bx.lo[1])), u), v_eq8(v_min8(u, v_set8(bx.hi[1])), u)));
+			in = v_and(in, v_and(v_eq8(v_max8(v, v_set8(bx.lo[2])), v), v_eq8(v_min8(v, v_set8(bx.hi[2])), v)));
+			mask = v_or(mask, v_and(in, v_set8(bx.bit)));
+		}
+		v_store(dst + x, mask);
+	}
+#endif
+
+	for (; x < width; x++, src += 2) {
+		// even pixels carry U, odd ones V
+		const uint8_t *mp = src - (x & 1) * 2;
+		dst[x] = classify(src[0], mp[1], mp[3]);
+	}
+}
+
+void ColorClassifier::classifyRows(const uint8_t *yuyv, int stride, uint8_t *dst, int dst_stride,
+								   int width, int rowBegin, int rowEnd) const
+{
+	for (int y = rowBegin; y < rowEnd; y++)
+		classify_row(yuyv + y * stride, dst + y * dst_stride, width);
+}
+
+void ColorClassifier::classify(const uint8_t *yuyv, int stride, uint8_t *dst, int dst_stride,
+							   int width, int height) const
+{
+	parallel_rows(height, 32, [&](int begin, int end) {
+		classifyRows(yuyv, stride, dst, dst_stride, width, begin, end);
+	});
+}
+
+void ColorClassifier::classifyRuns(const uint8_t *yuyv, int stride, int width, int rowBegin, int rowEnd,
+								   std::vector<ColorRun> &runs) const
+{
+	std::vector<uint8_t> row(width);
+
+	for (int y = rowBegin; y < rowEnd; y++) {
+		classify_row(yuyv + y * stride, &row[0], width);
+		for (int x = 0; x < width; ) {
+			uint8_t m = row[x];
+			int x0 = x;
+			while (++x < width && row[x] == m) {}
+			if (m) {
+				ColorRun r = { (uint16_t)x0, (uint16_t)x, (uint16_t)y, m };
+				runs.push_back(r);
+			}
+		}
+	}
+}
+
+} // namespace
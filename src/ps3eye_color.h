@@ -0,0 +1,73 @@
+#ifndef PS3EYE_COLOR_H
+#define PS3EYE_COLOR_H
+
+#include <stdint.h>
+#include <vector>
+
+namespace ps3eye {
+
+#define COLOR_MAX_CLASSES 8
+
+// a row segment of constant class mask
+struct ColorRun
+{
+	uint16_t x0, x1;	// [x0, x1)
+	uint16_t y;
+	uint8_t mask;		// bit c set for class c
+};
+
+/* Classifies the pixels of YUYV frames into up to 8 color classes, each
+ * pixel getting a byte with one bit per class. Both pixels of a YUYV
+ * macropixel use its shared U/V pair.
+ *
+ * Classes are made of YUV boxes and HSV ranges. While only boxes are
+ * defined (up to 16) they are compared directly with SIMD min/max, which
+ * needs no table lookups. HSV ranges are compiled into a 64x64x64 YUV
+ * table of class masks (256 KB, 4 levels per cell) and then every pixel
+ * is looked up there, boxes included. */
+class ColorClassifier
+{
+public:
+	ColorClassifier();
+
+	void clear();
+	// class c covers ymin <= Y <= ymax, umin <= U <= umax, vmin <= V <= vmax
+	bool addYUVBox(int c, uint8_t ymin, uint8_t ymax, uint8_t umin, uint8_t umax,
+				   uint8_t vmin, uint8_t vmax);
+	// class c covers hue hmin..hmax in degrees (wrapping through 0 if
+	// hmin > hmax), saturation and value in 0..1, from BT.601 video range YUV
+	bool addHSVRange(int c, float hmin, float hmax, float smin, float smax,
+					 float vmin, float vmax);
+
+	// class mask of one color
+	uint8_t classify(uint8_t y, uint8_t u, uint8_t v) const;
+
+	// one mask byte per pixel, rows are split over the worker threads
+	void classify(const uint8_t *yuyv, int stride, uint8_t *dst, int dst_stride,
+				  int width, int height) const;
+	// rows [rowBegin, rowEnd) of a frame, for row slices; both pointers are to row 0
+	void classifyRows(const uint8_t *yuyv, int stride, uint8_t *dst, int dst_stride,
+					  int width, int rowBegin, int rowEnd) const;
+	// runs of pixels with the same non zero mask, appended to runs
+	void classifyRuns(const uint8_t *yuyv, int stride, int width, int rowBegin, int rowEnd,
+					  std::vector<ColorRun> &runs) const;
+
+	bool usesTable() const { return use_table; }
+
+private:
+	struct Box
+	{
+		uint8_t lo[3], hi[3];	// Y, U, V
+		uint8_t bit;
+	};
+
+	void classify_row(const uint8_t *yuyv, uint8_t *dst, int width) const;
+
+	std::vector<Box> boxes;
+	std::vector<uint8_t> table;	// [Y >> 2][U >> 2][V >> 2]
+	bool use_table;
+};
+
+} // namespace
+
+#endif
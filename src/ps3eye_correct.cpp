@@ -0,0 +1,192 @@
+#include "ps3eye_correct.h"
+#include "ps3eye_simd.h"
+#include "ps3eye_parallel.h"
+
+#include <cstdio>
+#include <cstring>
+
+namespace ps3eye {
+
+#define GAIN_SHIFT		11
+#define HEADER_SIZE		16
+#define FILE_VERSION	1
+
+static const char file_magic[4] = { 'P', '3', 'F', 'C' };
+
+// offset of the gains, 16 byte aligned
+static size_t gain_offset(uint32_t width, uint32_t height)
+{
+	return HEADER_SIZE + (((size_t)width * height + 15) & ~(size_t)15);
+}
+
+FrameCorrection::FrameCorrection()
+{
+	width = height = 0;
+	dark = NULL;
+	gain = NULL;
+}
+
+bool FrameCorrection::setFrames(const uint8_t *darkFrame, const uint8_t *flatFrame, int stride,
+								uint32_t w, uint32_t h, PixelInput input)
+{
+	if (w == 0 || h == 0) return false;
+	file.close();
+	width = w;
+	height = h;
+
+	const uint32_t step = input == INPUT_YUYV ? 2 : 1;
+	dark_buf.assign((size_t)w * h, 0);
+	gain_buf.assign((size_t)w * h, 1 << GAIN_SHIFT);
+	if (darkFrame) {
+		for (uint32_t y = 0; y < h; y++)
+			for (uint32_t x = 0; x < w; x++)
+				dark_buf[y * w + x] = darkFrame[y * stride + x * step];
+	}
+
+	if (flatFrame) {
+		// mean response per Bayer phase, a single phase for YUYV
+		double sums[4] = { 0, 0, 0, 0 };
+		uint32_t counts[4] = { 0, 0, 0, 0 };
+		std::vector<int16_t> resp((size_t)w * h);
+		for (uint32_t y = 0; y < h; y++) {
+			for (uint32_t x = 0; x < w; x++) {
+				int r = flatFrame[y * stride + x * step] - dark_buf[y * w + x];
+				int phase = step == 1 ? (y & 1) * 2 + (x & 1) : 0;
+				resp[y * w + x] = (int16_t)r;
+				sums[phase] += r > 0 ? r : 0;
+				counts[phase]++;
+			}
+		}
+		for (uint32_t y = 0; y < h; y++) {
+			for (uint32_t x = 0; x < w; x++) {
+				int phase = step == 1 ? (y & 1) * 2 + (x & 1) : 0;
+				int r = resp[y * w + x];
+				double g = sums[phase] / counts[phase] / (r < 1 ? 1 : r) * (1 << GAIN_SHIFT);
+				gain_buf[y * w + x] = (int16_t)(g > 32767 ? 32767 : g + 0.5);
+			}
+		}
+	}
+
+	dark = &dark_buf[0];
+	gain = &gain_buf[0];
+	return true;
+}
+
+bool FrameCorrection::save(const char *path) const
+{
+	if (!isValid()) return false;
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) return false;
+
+	uint8_t header[HEADER_SIZE] = { 0 };
+	uint16_t version = FILE_VERSION, header_size = HEADER_SIZE;
+	memcpy(header, file_magic, 4);
+	memcpy(header + 4, &version, 2);
+	memcpy(header + 6, &header_size, 2);
+	memcpy(header + 8, &width, 4);
+	memcpy(header + 12, &height, 4);
+
+	size_t n = (size_t)width * height;
+	size_t pad_len = gain_offset(width, height) - HEADER_SIZE - n;
+	static const uint8_t pad[16] = { 0 };
+	bool ok = fwrite(header, HEADER_SIZE, 1, f) == 1 &&
+			  fwrite(dark, 1, n, f) == n &&
+			  fwrite(pad, 1, pad_len, f) == pad_len &&
+			  fwrite(gain, sizeof(int16_t), n, f) == n;
+	return fclose(f) == 0 && ok;
+}
+
+bool FrameCorrection::load(const char *path)
+{
+	dark = NULL;
+	gain = NULL;
+	width = height = 0;
+	dark_buf.clear();
+	gain_buf.clear();
+	if (!file.open(path)) return false;
+
+	const uint8_t *base = file.data();
+	uint16_t version = 0, header_size = 0;
+	uint32_t w = 0, h = 0;
+	if (file.size() >= HEADER_SIZE) {
+		memcpy(&version, base + 4, 2);
+		memcpy(&header_size, base + 6, 2);
+		memcpy(&w, base + 8, 4);
+		memcpy(&h, base + 12, 4);
+	}
+	if (file.size() < HEADER_SIZE || memcmp(base, file_magic, 4) != 0 || version != FILE_VERSION || header_size != HEADER_SIZE ||
+		w == 0 || h == 0 || w > 4096 || h > 4096 ||
+		file.size() < gain_offset(w, h) + (size_t)w * h * sizeof(int16_t)) {
+		file.close();
+		return false;
+	}
+	width = w;
+	height = h;
+	dark = base + HEADER_SIZE;
+	gain = (const int16_t*)(base + gain_offset(w, h));
+	return true;
+}
+
+// (in - dark) * gain with 2 fractional bits, then rounded
+static inline uint8_t correct(int v, int d, int g)
+{
+	int x = v - d;
+	x = x < 0 ? 0 : x;
+	int t = (((int16_t)(x << 7) * g) >> 16) + 2;
+	t >>= 2;
+	return (uint8_t)(t > 255 ? 255 : t);
+}
+
+void FrameCorrection::apply(uint8_t *frame, int stride, PixelInput input,
+							uint32_t rowBegin, uint32_t rowEnd) const
+{
+	if (!isValid()) return;
+	if (rowEnd > height) rowEnd = height;
+	const bool yuyv = input == INPUT_YUYV;
+
+#if PS3EYE_SIMD
+	const vec lo8 = v_set16(0xff), two = v_set16(2);
+#endif
+
+	for (uint32_t y = rowBegin; y < rowEnd; y++) {
+		uint8_t *row = frame + y * stride;
+		const uint8_t *dk = dark + y * width;
+		const int16_t *g = gain + y * width;
+		uint32_t x = 0;
+
+#if PS3EYE_SIMD
+		if (yuyv) {
+			// a pixel per 16 bit lane, Y in the low byte; the dark load
+			// reads a whole vector, hence the bound
+			for (; x + PS3EYE_SIMD_WIDTH <= width; x += PS3EYE_SIMD_WIDTH / 2) {
+				vec a = v_load(row + 2 * x);
+				vec d = v_max16(v_sub16(v_and(a, lo8), v_widen_lo(v_load(dk + x))), v_zero());
+				vec t = v_srli16(v_add16(v_mulhi16(v_slli16(d, 7), v_load(g + x)), two), 2);
+				v_store(row + 2 * x, v_or(v_min16(t, lo8), v_andnot(a, lo8)));
+			}
+		} else {
+			for (; x + PS3EYE_SIMD_WIDTH <= width; x += PS3EYE_SIMD_WIDTH) {
+				vec d = v_subs8(v_load(row + x), v_load(dk + x));
+				vec t0 = v_mulhi16(v_slli16(v_widen_lo(d), 7), v_load(g + x));
+				vec t1 = v_mulhi16(v_slli16(v_widen_hi(d), 7), v_load(g + x + PS3EYE_SIMD_WIDTH / 2));
+				v_store(row + x, v_pack16(v_srli16(v_add16(t0, two), 2), v_srli16(v_add16(t1, two), 2)));
+			}
+		}
+#endif
+
+		if (yuyv) {
+			for (; x < width; x++) row[2 * x] = correct(row[2 * x], dk[x], g[x]);
+		} else {
+			for (; x < width; x++) row[x] = correct(row[x], dk[x], g[x]);
+		}
+	}
+}
+
+void FrameCorrection::apply(uint8_t *frame, int stride, PixelInput input) const
+{
+	parallel_rows(height, 16, [=](int begin, int end) {
+		apply(frame, stride, input, begin, end);
+	});
+}
+
+} // namespace
@@ -0,0 +1,63 @@
+#ifndef PS3EYE_CORRECT_H
+#define PS3EYE_CORRECT_H
+
+#include "ps3eye_input.h"
+#include "ps3eye_mapfile.h"
+
+#include <vector>
+
+namespace ps3eye {
+
+/* Dark frame and flat field correction,
+ *
+ *	out = (in - dark) * gain
+ *
+ * per pixel, with an 8 bit dark offset and a gain with 11 fractional
+ * bits (up to 16x). The calibration is built from a dark frame and a
+ * flat frame, best stacked (see ps3eye_stack.h): the gain brings every
+ * pixel of the flat frame to the mean of the pixels of its Bayer phase,
+ * so vignetting and pixel response differences go while the color
+ * balance of the raw channels stays. Of YUYV frames only the luma is
+ * corrected.
+ *
+ * The calibration file is a 16 byte header followed by the dark offsets
+ * and the gains, little endian, and is mapped rather than read. */
+class FrameCorrection
+{
+public:
+	FrameCorrection();
+
+	// width x height frames of the given format; either may be NULL to
+	// skip that part of the correction
+	bool setFrames(const uint8_t *dark, const uint8_t *flat, int stride,
+				   uint32_t width, uint32_t height, PixelInput input);
+	// map a calibration file, false if it is missing or malformed
+	bool load(const char *path);
+	bool save(const char *path) const;
+
+	bool isValid() const { return dark != NULL; }
+	uint32_t getWidth() const { return width; }
+	uint32_t getHeight() const { return height; }
+
+	// correct rows [rowBegin, rowEnd) of a frame of the calibrated size in
+	// place, frame points to row 0
+	void apply(uint8_t *frame, int stride, PixelInput input,
+			   uint32_t rowBegin, uint32_t rowEnd) const;
+	// the whole frame, split over the worker threads
+	void apply(uint8_t *frame, int stride, PixelInput input) const;
+
+private:
+	FrameCorrection(const FrameCorrection&);
+	void operator=(const FrameCorrection&);
+
+	uint32_t width, height;
+	const uint8_t *dark;	// into dark_buf or the mapping
+	const int16_t *gain;
+	std::vector<uint8_t> dark_buf;
+	std::vector<int16_t> gain_buf;
+	MappedFile file;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,405 @@
+
+#include "ps3eye_demosaic.h"
+#include "ps3eye_simd.h"
+#include "ps3eye_parallel.h"
+
+#include <cstdlib>
+#include <vector>
+
+namespace ps3eye {
+
+// what a row of the mosaic holds: green on even or odd columns, and
+// whether its other color is red or blue
+struct row_layout
+{
+	bool green_even;
+	bool red_row;
+};
+
+static row_layout layout_of(BayerPattern pattern, int y)
+{
+	static const bool green_even[4][2] = { {false, true}, {true, false}, {true, false}, {false, true} };
+	static const bool red_row[4][2] = { {false, true}, {false, true}, {true, false}, {true, false} };
+	row_layout l;
+	l.green_even = green_even[pattern][y & 1];
+	l.red_row = red_row[pattern][y & 1];
+	return l;
+}
+
+// mirror around the border without repeating it, keeps the mosaic phase
+static inline int reflect(int i, int n)
+{
+	if (i < 0) return -i;
+	if (i >= n) return 2 * n - 2 - i;
+	return i;
+}
+
+static inline int avg(int a, int b) { return (a + b + 1) >> 1; }
+static inline uint8_t clamp8(int v) { return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v)); }
+static inline uint8_t luma(int r, int g, int b) { return (uint8_t)((77 * r + 150 * g + 29 * b + 128) >> 8); }
+
+int bayerOutputBytes(BayerOutput output)
+{
+	switch (output) {
+	case BAYER_RGB:
+	case BAYER_BGR:
+		return 3;
+	case BAYER_RGBA:
+	case BAYER_BGRA:
+		return 4;
+	default:
+		return 1;
+	}
+}
+
+static inline void put_pixel(BayerOutput output, uint8_t *dst, int x, int r, int g, int b)
+{
+	switch (output) {
+	case BAYER_RGB:
+		dst += x * 3; dst[0] = r; dst[1] = g; dst[2] = b;
+		break;
+	case BAYER_BGR:
+		dst += x * 3; dst[0] = b; dst[1] = g; dst[2] = r;
+		break;
+	case BAYER_RGBA:
+		dst += x * 4; dst[0] = r; dst[1] = g; dst[2] = b; dst[3] = 0xff;
+		break;
+	case BAYER_BGRA:
+		dst += x * 4; dst[0] = b; dst[1] = g; dst[2] = r; dst[3] = 0xff;
+		break;
+	case BAYER_GRAY:
+		dst[x] = luma(r, g, b);
+		break;
+	default:
+		break;
+	}
+}
+
+#if PS3EYE_SIMD
+
+static inline vec green_mask(bool green_even)
+{
+	static const uint8_t lanes[PS3EYE_SIMD_WIDTH + 1] = {
+		0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0,
+#if PS3EYE_SIMD_WIDTH > 16
+		0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0, 0xff, 0,
+#endif
+		0xff
+	};
+	return v_load(lanes + (green_even ? 0 : 1));
+}
+
+static inline void put_vec(BayerOutput output, uint8_t *dst, int x, vec r, vec g, vec b)
+{
+	switch (output) {
+	case BAYER_RGB:
+	case BAYER_BGR: {
+		uint8_t pr[PS3EYE_SIMD_WIDTH], pg[PS3EYE_SIMD_WIDTH], pb[PS3EYE_SIMD_WIDTH];
+		v_store(pr, r); v_store(pg, g); v_store(pb, b);
+		for (int i = 0; i < PS3EYE_SIMD_WIDTH; i++)
+			put_pixel(output, dst, x + i, pr[i], pg[i], pb[i]);
+		break;
+	}
+	case BAYER_RGBA:
+	case BAYER_BGRA: {
+		vec c0 = output == BAYER_RGBA ? r : b;
+		vec c2 = output == BAYER_RGBA ? b : r;
+		vec lo01, hi01, lo23, hi23, o0, o1, o2, o3;
+		v_zip8(c0, g, lo01, hi01);
+		v_zip8(c2, v_set8(0xff), lo23, hi23);
+		v_zip16(lo01, lo23, o0, o1);
+		v_zip16(hi01, hi23, o2, o3);
+		dst += x * 4;
+		v_store(dst, o0);
+		v_store(dst + PS3EYE_SIMD_WIDTH, o1);
+		v_store(dst + PS3EYE_SIMD_WIDTH * 2, o2);
+		v_store(dst + PS3EYE_SIMD_WIDTH * 3, o3);
+		break;
+	}
+	case BAYER_GRAY: {
+		const vec kr = v_set16(77), kg = v_set16(150), kb = v_set16(29), half = v_set16(128);
+		vec lo = v_add16(v_add16(v_mullo16(v_widen_lo(r), kr), v_mullo16(v_widen_lo(g), kg)),
+						 v_add16(v_mullo16(v_widen_lo(b), kb), half));
+		vec hi = v_add16(v_add16(v_mullo16(v_widen_hi(r), kr), v_mullo16(v_widen_hi(g), kg)),
+						 v_add16(v_mullo16(v_widen_hi(b), kb), half));
+		v_store(dst + x, v_pack16(v_srli16(lo, 8), v_srli16(hi, 8)));
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+#endif
+
+// bilinear: every missing color is the rounded average of its nearest
+// neighbours of that color in the 3x3 window
+static void bilinear_row(const uint8_t *pm, const uint8_t *p0, const uint8_t *pp, int w,
+						 row_layout l, BayerOutput output, uint8_t *dst)
+{
+	int x = 0;
+
+#if PS3EYE_SIMD
+	for (; x < 2 && x < w; x++) {
+#else
+	for (; x < w; x++) {
+#endif
+		int xl = reflect(x - 1, w), xr = reflect(x + 1, w);
+		int c = p0[x];
+		int h = avg(p0[xl], p0[xr]);
+		int v = avg(pm[x], pp[x]);
+		int x4 = avg(h, v);
+		int d4 = avg(avg(pm[xl], pm[xr]), avg(pp[xl], pp[xr]));
+		bool green = ((x & 1) == 0) == l.green_even;
+		int g = green ? c : x4;
+		int a = green ? h : c;
+		int o = green ? v : d4;
+		put_pixel(output, dst, x, l.red_row ? a : o, g, l.red_row ? o : a);
+	}
+
+#if PS3EYE_SIMD
+	const vec gmask = green_mask(l.green_even);
+	for (; x + PS3EYE_SIMD_WIDTH + 1 <= w; x += PS3EYE_SIMD_WIDTH) {
+		vec c = v_load(p0 + x);
+		vec h = v_avg8(v_load(p0 + x - 1), v_load(p0 + x + 1));
+		vec v = v_avg8(v_load(pm + x), v_load(pp + x));
+		vec x4 = v_avg8(h, v);
+		vec d4 = v_avg8(v_avg8(v_load(pm + x - 1), v_load(pm + x + 1)),
+						v_avg8(v_load(pp + x - 1), v_load(pp + x + 1)));
+		vec g = v_select(gmask, c, x4);
+		vec a = v_select(gmask, h, c);
+		vec o = v_select(gmask, v, d4);
+		if (l.red_row)
+			put_vec(output, dst, x, a, g, o);
+		else
+			put_vec(output, dst, x, o, g, a);
+	}
+
+	for (; x < w; x++) {
+		int xl = reflect(x - 1, w), xr = reflect(x + 1, w);
+		int c = p0[x];
+		int h = avg(p0[xl], p0[xr]);
+		int v = avg(pm[x], pp[x]);
+		int x4 = avg(h, v);
+		int d4 = avg(avg(pm[xl], pm[xr]), avg(pp[xl], pp[xr]));
+		bool green = ((x & 1) == 0) == l.green_even;
+		int g = green ? c : x4;
+		int a = green ? h : c;
+		int o = green ? v : d4;
+		put_pixel(output, dst, x, l.red_row ? a : o, g, l.red_row ? o : a);
+	}
+#endif
+}
+
+// green plane of one row: at red/blue sites interpolate along the
+// direction with the smaller gradient, with a second order correction
+static inline uint8_t green_at(const uint8_t *pmm, const uint8_t *pm, const uint8_t *p0,
+							   const uint8_t *pp, const uint8_t *ppp, int x, int w)
+{
+	int xl = reflect(x - 1, w), xr = reflect(x + 1, w);
+	int xll = reflect(x - 2, w), xrr = reflect(x + 2, w);
+	int c2 = p0[x] * 2;
+	int dh = std::abs(p0[xl] - p0[xr]) + std::abs(c2 - p0[xll] - p0[xrr]);
+	int dv = std::abs(pm[x] - pp[x]) + std::abs(c2 - pmm[x] - ppp[x]);
+	int gh = clamp8((2 * (p0[xl] + p0[xr]) + c2 - p0[xll] - p0[xrr] + 2) >> 2);
+	int gv = clamp8((2 * (pm[x] + pp[x]) + c2 - pmm[x] - ppp[x] + 2) >> 2);
+	if (dh < dv) return gh;
+	if (dv < dh) return gv;
+	return (uint8_t)((gh + gv + 1) >> 1);
+}
+
+static void green_row(const uint8_t *pmm, const uint8_t *pm, const uint8_t *p0,
+					  const uint8_t *pp, const uint8_t *ppp, int w, row_layout l, uint8_t *g)
+{
+	int x = 0;
+
+#if PS3EYE_SIMD
+	for (; x < 2 && x < w; x++)
+#else
+	for (; x < w; x++)
+#endif
+		g[x] = (((x & 1) == 0) == l.green_even) ? p0[x] : green_at(pmm, pm, p0, pp, ppp, x, w);
+
+#if PS3EYE_SIMD
+	const vec gmask = green_mask(l.green_even);
+	const vec two = v_set16(2), one = v_set16(1);
+	for (; x + PS3EYE_SIMD_WIDTH + 2 <= w; x += PS3EYE_SIMD_WIDTH) {
+		vec c8 = v_load(p0 + x);
+		vec s8[8] = {
+			v_load(p0 + x - 1), v_load(p0 + x + 1), v_load(p0 + x - 2), v_load(p0 + x + 2),
+			v_load(pm + x), v_load(pp + x), v_load(pmm + x), v_load(ppp + x)
+		};
+		vec res[2];
+		for (int half = 0; half < 2; half++) {
+			vec c2 = v_slli16(half ? v_widen_hi(c8) : v_widen_lo(c8), 1);
+			vec s[8];
+			for (int i = 0; i < 8; i++)
+				s[i] = half ? v_widen_hi(s8[i]) : v_widen_lo(s8[i]);
+			vec cor_h = v_sub16(v_sub16(c2, s[2]), s[3]);
+			vec cor_v = v_sub16(v_sub16(c2, s[6]), s[7]);
+			vec dh = v_add16(v_abs16(v_sub16(s[0], s[1])), v_abs16(cor_h));
+			vec dv = v_add16(v_abs16(v_sub16(s[4], s[5])), v_abs16(cor_v));
+			vec gh = v_srai16(v_add16(v_add16(v_slli16(v_add16(s[0], s[1]), 1), cor_h), two), 2);
+			vec gv = v_srai16(v_add16(v_add16(v_slli16(v_add16(s[4], s[5]), 1), cor_v), two), 2);
+			gh = v_max16(v_min16(gh, v_set16(255)), v_zero());
+			gv = v_max16(v_min16(gv, v_set16(255)), v_zero());
+			vec ga = v_srai16(v_add16(v_add16(gh, gv), one), 1);
+			res[half] = v_select(v_gt16(dv, dh), gh, v_select(v_gt16(dh, dv), gv, ga));
+		}
+		v_store(g + x, v_select(gmask, c8, v_pack16(res[0], res[1])));
+	}
+
+	for (; x < w; x++)
+		g[x] = (((x & 1) == 0) == l.green_even) ? p0[x] : green_at(pmm, pm, p0, pp, ppp, x, w);
+#endif
+}
+
+// red and blue from color differences against the interpolated green
+static void chroma_row(const uint8_t *pm, const uint8_t *p0, const uint8_t *pp,
+					   const uint8_t *gm, const uint8_t *g0, const uint8_t *gp,
+					   int w, row_layout l, BayerOutput output, uint8_t *dst)
+{
+	int x = 0;
+
+#if PS3EYE_SIMD
+	for (; x < 2 && x < w; x++) {
+#else
+	for (; x < w; x++) {
+#endif
+		int xl = reflect(x - 1, w), xr = reflect(x + 1, w);
+		int g = g0[x], a, o;
+		if (((x & 1) == 0) == l.green_even) {
+			a = clamp8((2 * g + (p0[xl] - g0[xl]) + (p0[xr] - g0[xr]) + 1) >> 1);
+			o = clamp8((2 * g + (pm[x] - gm[x]) + (pp[x] - gp[x]) + 1) >> 1);
+		} else {
+			a = p0[x];
+			o = clamp8((4 * g + (pm[xl] - gm[xl]) + (pm[xr] - gm[xr]) +
+						(pp[xl] - gp[xl]) + (pp[xr] - gp[xr]) + 2) >> 2);
+		}
+		put_pixel(output, dst, x, l.red_row ? a : o, g, l.red_row ? o : a);
+	}
+
+#if PS3EYE_SIMD
+	const vec gmask = green_mask(l.green_even);
+	const vec one = v_set16(1), two = v_set16(2);
+	for (; x + PS3EYE_SIMD_WIDTH + 1 <= w; x += PS3EYE_SIMD_WIDTH) {
+		vec c8 = v_load(p0 + x), g8 = v_load(g0 + x);
+		// raw/green pairs: left, right, up, down, up left, up right, down left, down right
+		vec r8[8] = {
+			v_load(p0 + x - 1), v_load(p0 + x + 1), v_load(pm + x), v_load(pp + x),
+			v_load(pm + x - 1), v_load(pm + x + 1), v_load(pp + x - 1), v_load(pp + x + 1)
+		};
+		vec q8[8] = {
+			v_load(g0 + x - 1), v_load(g0 + x + 1), v_load(gm + x), v_load(gp + x),
+			v_load(gm + x - 1), v_load(gm + x + 1), v_load(gp + x - 1), v_load(gp + x + 1)
+		};
+		vec hv[2], vv[2], dv[2];
+		for (int half = 0; half < 2; half++) {
+			vec g = half ? v_widen_hi(g8) : v_widen_lo(g8);
+			vec d[8];
+			for (int i = 0; i < 8; i++)
+				d[i] = v_sub16(half ? v_widen_hi(r8[i]) : v_widen_lo(r8[i]),
+							   half ? v_widen_hi(q8[i]) : v_widen_lo(q8[i]));
+			vec g2 = v_slli16(g, 1);
+			hv[half] = v_srai16(v_add16(v_add16(g2, v_add16(d[0], d[1])), one), 1);
+			vv[half] = v_srai16(v_add16(v_add16(g2, v_add16(d[2], d[3])), one), 1);
+			dv[half] = v_srai16(v_add16(v_add16(v_slli16(g, 2),
+									v_add16(v_add16(d[4], d[5]), v_add16(d[6], d[7]))), two), 2);
+		}
+		vec a = v_select(gmask, v_pack16(hv[0], hv[1]), c8);
+		vec o = v_select(gmask, v_pack16(vv[0], vv[1]), v_pack16(dv[0], dv[1]));
+		if (l.red_row)
+			put_vec(output, dst, x, a, g8, o);
+		else
+			put_vec(output, dst, x, o, g8, a);
+	}
+
+	for (; x < w; x++) {
+		int xl = reflect(x - 1, w), xr = reflect(x + 1, w);
+		int g = g0[x], a, o;
+		if (((x & 1) == 0) == l.green_even) {
+			a = clamp8((2 * g + (p0[xl] - g0[xl]) + (p0[xr] - g0[xr]) + 1) >> 1);
+			o = clamp8((2 * g + (pm[x] - gm[x]) + (pp[x] - gp[x]) + 1) >> 1);
+		} else {
+			a = p0[x];
+			o = clamp8((4 * g + (pm[xl] - gm[xl]) + (pm[xr] - gm[xr]) +
+						(pp[xl] - gp[xl]) + (pp[xr] - gp[xr]) + 2) >> 2);
+		}
+		put_pixel(output, dst, x, l.red_row ? a : o, g, l.red_row ? o : a);
+	}
+#endif
+}
+
+struct demosaic_job
+{
+	const uint8_t *src;
+	int src_stride;
+	uint8_t *dst;
+	int dst_stride;
+	int width;
+	int height;
+	BayerPattern pattern;
+	BayerOutput output;
+
+	const uint8_t *row(int y) const { return src + reflect(y, height) * src_stride; }
+};
+
+static void bilinear_band(void *ctx, int begin, int end)
+{
+	const demosaic_job &j = *static_cast<demosaic_job*>(ctx);
+	for (int y = begin; y < end; y++)
+		bilinear_row(j.row(y - 1), j.row(y), j.row(y + 1), j.width,
+					 layout_of(j.pattern, y), j.output, j.dst + y * j.dst_stride);
+}
+
+static void edge_aware_band(void *ctx, int begin, int end)
+{
+	const demosaic_job &j = *static_cast<demosaic_job*>(ctx);
+	const int w = j.width;
+	// green rows begin - 1 .. end, reflected at the image borders
+	std::vector<uint8_t> green((end - begin + 2) * w);
+	int y;
+
+	for (y = begin - 1; y <= end; y++) {
+		int ry = reflect(y, j.height);
+		green_row(j.row(ry - 2), j.row(ry - 1), j.row(ry), j.row(ry + 1), j.row(ry + 2), w,
+				  layout_of(j.pattern, ry), &green[(y - begin + 1) * w]);
+	}
+	for (y = begin; y < end; y++) {
+		const uint8_t *g0 = &green[(y - begin + 1) * w];
+		chroma_row(j.row(y - 1), j.row(y), j.row(y + 1), g0 - w, g0, g0 + w, w,
+				   layout_of(j.pattern, y), j.output, j.dst + y * j.dst_stride);
+	}
+}
+
+void demosaic(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+			  int width, int height, BayerPattern pattern,
+			  BayerOutput output, DemosaicMethod method)
+{
+	demosaic_job job;
+
+	if (width < 2 || height < 2 || output == BAYER_RAW)
+		return;
+
+	job.src = src;
+	job.src_stride = src_stride;
+	job.dst = dst;
+	job.dst_stride = dst_stride;
+	job.width = width;
+	job.height = height;
+	job.pattern = pattern;
+	job.output = output;
+
+	if (method == DEMOSAIC_EDGE_AWARE)
+		parallel_rows(height, 32, edge_aware_band, &job);
+	else
+		parallel_rows(height, 16, bilinear_band, &job);
+}
+
+void bayerToGray(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+				 int width, int height, BayerPattern pattern)
+{
+	demosaic(src, src_stride, dst, dst_stride, width, height, pattern, BAYER_GRAY, DEMOSAIC_BILINEAR);
+}
+
+} // namespace
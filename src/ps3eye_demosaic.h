@@ -0,0 +1,48 @@
+#ifndef PS3EYE_DEMOSAIC_H
+#define PS3EYE_DEMOSAIC_H
+
+#include <stdint.h>
+
+namespace ps3eye {
+
+// colors of the top left 2x2 block of the mosaic
+enum BayerPattern
+{
+	BAYER_BGGR = 0,
+	BAYER_GBRG,
+	BAYER_GRBG,
+	BAYER_RGGB
+};
+
+enum DemosaicMethod
+{
+	DEMOSAIC_BILINEAR = 0,	// 3x3 neighbour averages, fastest
+	DEMOSAIC_EDGE_AWARE		// gradient directed green, color difference chroma
+};
+
+enum BayerOutput
+{
+	BAYER_RAW = 0,	// no conversion, 1 byte per pixel mosaic
+	BAYER_RGB,		// 3 bytes per pixel
+	BAYER_BGR,
+	BAYER_RGBA,		// 4 bytes per pixel, alpha 255
+	BAYER_BGRA,
+	BAYER_GRAY		// Y8 only, BT.601 luma straight from the mosaic
+};
+
+// bytes per output pixel of a conversion
+int bayerOutputBytes(BayerOutput output);
+
+// Convert a mosaic to color or gray. Rows are split over the worker
+// threads (see ps3eye_parallel.h). Width and height must be at least 2.
+void demosaic(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+			  int width, int height, BayerPattern pattern,
+			  BayerOutput output, DemosaicMethod method = DEMOSAIC_BILINEAR);
+
+// fused Bayer -> Y8 path for trackers, same as demosaic(.., BAYER_GRAY, DEMOSAIC_BILINEAR)
+void bayerToGray(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+				 int width, int height, BayerPattern pattern);
+
+} // namespace
+
+#endif
@@ -0,0 +1,126 @@
+#include "ps3eye_denoise.h"
+#include "ps3eye_simd.h"
+#include "ps3eye_parallel.h"
+
+namespace ps3eye {
+
+#define STATE_SHIFT	7
+#define WEIGHT_ONE	32767
+
+TemporalDenoise::TemporalDenoise()
+{
+	t_low = 6;
+	t_high = 24;
+	k_min = 0;
+	slope = 0;
+	row_bytes = num_rows = 0;
+	setStrength(0.75f);
+}
+
+void TemporalDenoise::setStrength(float s)
+{
+	if (s < 0) s = 0;
+	if (s > 0.97f) s = 0.97f;
+	strength = s;
+	k_min = (int16_t)((1 - s) * WEIGHT_ONE + 0.5f);
+	slope = (int16_t)((WEIGHT_ONE - k_min) / (t_high - t_low));
+}
+
+void TemporalDenoise::setMotionThresholds(uint8_t low, uint8_t high)
+{
+	t_low = low;
+	t_high = high > low ? high : low + 1;
+	setStrength(strength);
+}
+
+void TemporalDenoise::reset()
+{
+	row_valid.assign(row_valid.size(), 0);
+}
+
+/* state += 2 * mulhi(delta, k), which is delta * k / 32768 rounded down
+ * to state units; the output is the state rounded to a byte. */
+static inline uint8_t filter_byte(uint8_t x, int16_t &s, int k_min, int slope, int t_low, int t_high)
+{
+	int x7 = x << STATE_SHIFT;
+	int delta = x7 - s;
+	int ad = (delta < 0 ? -delta : delta) >> STATE_SHIFT;
+
+	if (ad >= t_high) {
+		s = (int16_t)x7;
+	} else {
+		int e = ad - t_low;
+		e = e < 0 ? 0 : e;
+		int k = k_min + e * slope;
+		s = (int16_t)(s + ((delta * k) >> 16) * 2);
+	}
+	int out = (s + (1 << (STATE_SHIFT - 1))) >> STATE_SHIFT;
+	return (uint8_t)(out < 0 ? 0 : (out > 255 ? 255 : out));
+}
+
+void TemporalDenoise::filter_rows(uint8_t *frame, int stride, uint32_t begin, uint32_t end)
+{
+#if PS3EYE_SIMD
+	const vec kmin = v_set16(k_min), vslope = v_set16(slope);
+	const vec tlow = v_set16(t_low), span = v_set16((int16_t)(t_high - t_low));
+	const vec thigh = v_set16((int16_t)(t_high - 1)), round = v_set16(1 << (STATE_SHIFT - 1));
+#endif
+
+	for (uint32_t y = begin; y < end; y++) {
+		uint8_t *row = frame + y * stride;
+		int16_t *s = &state[y * row_bytes];
+		uint32_t x = 0;
+
+		if (!row_valid[y]) {
+			for (x = 0; x < row_bytes; x++) s[x] = (int16_t)(row[x] << STATE_SHIFT);
+			row_valid[y] = 1;
+			continue;
+		}
+
+#if PS3EYE_SIMD
+		for (; x + PS3EYE_SIMD_WIDTH <= row_bytes; x += PS3EYE_SIMD_WIDTH) {
+			vec x8 = v_load(row + x), out[2];
+			for (int half = 0; half < 2; half++) {
+				int16_t *sp = s + x + half * (PS3EYE_SIMD_WIDTH / 2);
+				vec x7 = v_slli16(half ? v_widen_hi(x8) : v_widen_lo(x8), STATE_SHIFT);
+				vec sv = v_load(sp);
+				vec delta = v_sub16(x7, sv);
+				vec ad = v_srli16(v_abs16(delta), STATE_SHIFT);
+				vec e = v_min16(v_max16(v_sub16(ad, tlow), v_zero()), span);
+				vec k = v_add16(kmin, v_mullo16(e, vslope));
+				vec ns = v_add16(sv, v_slli16(v_mulhi16(delta, k), 1));
+				ns = v_select(v_gt16(ad, thigh), x7, ns);
+				v_store(sp, ns);
+				out[half] = v_srai16(v_add16(ns, round), STATE_SHIFT);
+			}
+			v_store(row + x, v_pack16(out[0], out[1]));
+		}
+#endif
+
+		for (; x < row_bytes; x++)
+			row[x] = filter_byte(row[x], s[x], k_min, slope, t_low, t_high);
+	}
+}
+
+void TemporalDenoise::apply(uint8_t *frame, int stride, uint32_t rowBytes, uint32_t rows,
+							uint32_t rowBegin, uint32_t rowEnd)
+{
+	if (rowBytes != row_bytes || rows != num_rows) {
+		row_bytes = rowBytes;
+		num_rows = rows;
+		state.assign(rowBytes * rows, 0);
+		row_valid.assign(rows, 0);
+	}
+	if (rowEnd > rows) rowEnd = rows;
+	if (rowBegin < rowEnd) filter_rows(frame, stride, rowBegin, rowEnd);
+}
+
+void TemporalDenoise::apply(uint8_t *frame, int stride, uint32_t rowBytes, uint32_t rows)
+{
+	apply(frame, stride, rowBytes, rows, 0, 0);
+	parallel_rows(rows, 16, [=](int begin, int end) {
+		filter_rows(frame, stride, begin, end);
+	});
+}
+
+} // namespace
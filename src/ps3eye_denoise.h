@@ -0,0 +1,54 @@
+#ifndef PS3EYE_DENOISE_H
+#define PS3EYE_DENOISE_H
+
+#include <stdint.h>
+#include <vector>
+
+namespace ps3eye {
+
+/* Recursive temporal noise filter. Each byte moves from the previous
+ * output towards the new frame by a weight that depends on how far it
+ * moved: differences up to the low threshold are treated as noise and
+ * get the full filter strength, from the high threshold up they are
+ * motion and pass through unfiltered, and the weight ramps in between.
+ *
+ * Bytes are filtered independently, so YUYV, Y8 and raw Bayer frames
+ * all work. The state is kept with 7 fractional bits so small steady
+ * changes still come through instead of sticking at the last output. */
+class TemporalDenoise
+{
+public:
+	TemporalDenoise();
+
+	// share of the previous output kept where nothing moves, 0 .. 0.97, default 0.75
+	void setStrength(float strength);
+	float getStrength() const { return strength; }
+	// differences in levels, defaults 6 and 24
+	void setMotionThresholds(uint8_t low, uint8_t high);
+	// start over with the next frame
+	void reset();
+
+	// filter rows [rowBegin, rowEnd) of a frame in place, frame points to
+	// row 0. Rows are independent, so a frame can be filtered as its rows
+	// arrive; rows not filtered before are taken as they are.
+	void apply(uint8_t *frame, int stride, uint32_t rowBytes, uint32_t rows,
+			   uint32_t rowBegin, uint32_t rowEnd);
+	// the whole frame, split over the worker threads
+	void apply(uint8_t *frame, int stride, uint32_t rowBytes, uint32_t rows);
+
+private:
+	void filter_rows(uint8_t *frame, int stride, uint32_t begin, uint32_t end);
+
+	float strength;
+	int16_t k_min;		// weight of the new frame below the low threshold, 1/32768 units
+	int16_t slope;		// weight added per level above it
+	uint8_t t_low, t_high;
+
+	uint32_t row_bytes, num_rows;
+	std::vector<int16_t> state;		// previous output, 7 fractional bits
+	std::vector<uint8_t> row_valid;
+};
+
+} // namespace
+
+#endif
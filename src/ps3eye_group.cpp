@@ -0,0 +1,389 @@
+#include "ps3eye_group.h"
+
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <thread>
+
+namespace ps3eye {
+
+#define DEFAULT_MAX_PENDING	4
+#define DEFAULT_MAX_SETS	2
+#define MAX_HELD_FRAMES		14	/* completed frames the ring keeps safely */
+#define PHASE_SMOOTHING		0.1	/* weight of a new phase measurement */
+#define PHASE_MIN_SAMPLES	10	/* before a phase is trusted */
+#define REPHASE_PERIODS		30	/* frames between corrections */
+
+static const double PI = 3.14159265358979323846;
+
+CameraGroup::CameraGroup()
+{
+	window = 0;
+	time_source = GROUP_CLOCK_HOST;
+	max_pending = DEFAULT_MAX_PENDING;
+	max_sets = DEFAULT_MAX_SETS;
+	drop_policy = GROUP_DROP_OLDEST;
+	dropped_frames = 0;
+	dropped_sets = 0;
+	staggered = false;
+	period = 0;
+	phase_tolerance = 0.05;
+	last_rephase = 0;
+	rephase_count = 0;
+}
+
+void CameraGroup::addCamera(PS3EYECam::PS3EYERef cam)
+{
+	Member m;
+	m.cam = cam;
+	// only frames completed from now on take part
+	m.next_seq = cam->getFrameCount();
+	m.last_time = m.last_device_time = 0;
+	m.phase_x = m.phase_y = 0;
+	m.phase_samples = 0;
+	cams.push_back(m);
+	ready.clear();
+}
+
+double CameraGroup::getWindow() const
+{
+	double rate = 0;
+
+	if(window > 0) return window;
+	for(size_t i = 0; i < cams.size(); i++)
+	{
+		double r = cams[i].cam->getFrameRateExact();
+		if(r > 0 && (rate == 0 || r < rate)) rate = r;
+	}
+	return 0.5 / (rate > 0 ? rate : 60.0);
+}
+
+void CameraGroup::setMaxPending(uint32_t frames)
+{
+	max_pending = (std::max)(1u, (std::min)(frames, (uint32_t)MAX_HELD_FRAMES));
+}
+
+void CameraGroup::setMaxSets(uint32_t sets, GroupDropPolicy policy)
+{
+	max_sets = (std::max)(1u, sets);
+	drop_policy = policy;
+}
+
+double CameraGroup::frame_time(const FrameInfo &info) const
+{
+	return time_source == GROUP_CLOCK_DEVICE ? info.device_time : info.timestamp;
+}
+
+// move the frames completed since the last call to the pending queue
+void CameraGroup::collect(Member &m)
+{
+	uint32_t count = m.cam->getFrameCount();
+	FrameInfo info;
+
+	if(count < m.next_seq)
+	{
+		// the stream was restarted, sequences begin again at 0
+		dropped_frames += m.pending.size();
+		m.pending.clear();
+		m.next_seq = 0;
+	}
+	if(count - m.next_seq > MAX_HELD_FRAMES)
+	{
+		dropped_frames += count - m.next_seq - MAX_HELD_FRAMES;
+		m.next_seq = count - MAX_HELD_FRAMES;
+	}
+
+	for(; m.next_seq != count; m.next_seq++)
+	{
+		if(m.cam->getFramePointer(m.next_seq, &info) == NULL)
+		{
+			dropped_frames++;
+			continue;
+		}
+		Pending p = { m.next_seq, info };
+		m.pending.push_back(p);
+		m.last_time = frame_time(info);
+		m.last_device_time = info.device_time;
+	}
+
+	// whatever the ring no longer holds
+	while(!m.pending.empty() && m.cam->getFramePointer(m.pending.front().sequence) == NULL)
+	{
+		m.pending.pop_front();
+		dropped_frames++;
+	}
+}
+
+/* Take the oldest pending frame of every camera. If they are all within
+ * the window they form a set; otherwise the oldest of them can never be
+ * matched, as every camera's later frames are later still, and is dropped. */
+void CameraGroup::match()
+{
+	double win = getWindow();
+	size_t i;
+
+	for(;;)
+	{
+		size_t oldest = 0;
+		double t_min = 0, t_max = 0;
+
+		for(i = 0; i < cams.size(); i++)
+		{
+			if(cams[i].pending.empty()) return;
+			double t = frame_time(cams[i].pending.front().info);
+			if(i == 0 || t < t_min) { t_min = t; oldest = i; }
+			if(i == 0 || t > t_max) t_max = t;
+		}
+
+		if(t_max - t_min > win)
+		{
+			cams[oldest].pending.pop_front();
+			dropped_frames++;
+			continue;
+		}
+
+		Match m;
+		m.seq.resize(cams.size());
+		for(i = 0; i < cams.size(); i++)
+		{
+			m.seq[i] = cams[i].pending.front().sequence;
+			cams[i].pending.pop_front();
+		}
+
+		if(ready.size() < max_sets)
+		{
+			ready.push_back(m);
+		} else if(drop_policy == GROUP_DROP_OLDEST) {
+			ready.pop_front();
+			ready.push_back(m);
+			dropped_sets++;
+		} else {
+			dropped_sets++;
+		}
+	}
+}
+
+bool CameraGroup::resolve(const Match &match, FrameSet &set) const
+{
+	double t_min = 0, t_max = 0, t_sum = 0;
+
+	set.frames.resize(cams.size());
+	set.info.resize(cams.size());
+	for(size_t i = 0; i < cams.size(); i++)
+	{
+		set.frames[i] = cams[i].cam->getFramePointer(match.seq[i], &set.info[i]);
+		if(set.frames[i] == NULL) return false;
+
+		double t = frame_time(set.info[i]);
+		if(i == 0 || t < t_min) t_min = t;
+		if(i == 0 || t > t_max) t_max = t;
+		t_sum += t;
+	}
+	set.timestamp = t_sum / cams.size();
+	set.spread = t_max - t_min;
+	return true;
+}
+
+void CameraGroup::start()
+{
+	for(size_t i = 0; i < cams.size(); i++)
+	{
+		cams[i].cam->start();
+	}
+	staggered = false;
+}
+
+bool CameraGroup::startStaggered()
+{
+	size_t i;
+
+	if(cams.empty()) return false;
+	period = 1.0 / cams[0].cam->getFrameRateExact();
+	for(i = 1; i < cams.size(); i++)
+	{
+		if(std::fabs(cams[i].cam->getFrameRateExact() * period - 1.0) > 0.001)
+			return false;
+	}
+
+	// everything but the sensor output first, so only the start
+	// register write remains between the cameras
+	for(i = 0; i < cams.size(); i++)
+	{
+		cams[i].cam->start(false);
+	}
+
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	for(i = 0; i < cams.size(); i++)
+	{
+		std::this_thread::sleep_until(t0 + std::chrono::microseconds((int64_t)(1e6 * period * i / cams.size())));
+		cams[i].cam->streamOn();
+	}
+
+	for(i = 0; i < cams.size(); i++)
+	{
+		Member &m = cams[i];
+		dropped_frames += m.pending.size();
+		m.pending.clear();
+		m.next_seq = m.cam->getFrameCount();
+		m.last_time = m.last_device_time = 0;
+		m.phase_x = m.phase_y = 0;
+		m.phase_samples = 0;
+	}
+	ready.clear();
+	last_rephase = 0;
+	staggered = true;
+	return true;
+}
+
+void CameraGroup::stop()
+{
+	for(size_t i = 0; i < cams.size(); i++)
+	{
+		cams[i].cam->stop();
+	}
+}
+
+double CameraGroup::getPhase(size_t i) const
+{
+	const Member &m = cams[i];
+
+	if(i == 0) return 0;
+	if(m.phase_samples < PHASE_MIN_SAMPLES) return -1;
+	double ph = std::atan2(m.phase_y, m.phase_x) / (2 * PI);
+	return ph < 0 ? ph + 1 : ph;
+}
+
+// phase of the newest frame of m after the newest frame of camera 0
+void CameraGroup::measure_phase(Member &m)
+{
+	if(m.last_device_time == 0 || cams[0].last_device_time == 0) return;
+
+	double a = 2 * PI * (m.last_device_time - cams[0].last_device_time) / period;
+	m.phase_x += (std::cos(a) - m.phase_x) * PHASE_SMOOTHING;
+	m.phase_y += (std::sin(a) - m.phase_y) * PHASE_SMOOTHING;
+	m.phase_samples++;
+}
+
+/* Delay the first camera that is off its slot by more than the tolerance.
+ * Frames can only be made longer, so a camera that is ahead waits for
+ * nearly a whole period. One correction at a time, and only once the
+ * phases have been measured again since the last one. */
+void CameraGroup::rephase()
+{
+	size_t i, n = cams.size();
+
+	if(cams[0].last_device_time - last_rephase < REPHASE_PERIODS * period) return;
+	for(i = 0; i < n; i++)
+	{
+		if(cams[i].cam->isDelayingFrame()) return;
+	}
+
+	for(i = 1; i < n; i++)
+	{
+		Member &m = cams[i];
+		double ph = getPhase(i);
+		if(ph < 0) continue;
+
+		double err = ph - (double)i / n;
+		err -= std::floor(err + 0.5);
+		if(std::fabs(err) <= phase_tolerance) continue;
+
+		if(m.cam->delayFrame((-err - std::floor(-err)) * period))
+		{
+			m.phase_x = m.phase_y = 0;
+			m.phase_samples = 0;
+			last_rephase = cams[0].last_device_time;
+			rephase_count++;
+		}
+		return;
+	}
+}
+
+void CameraGroup::update()
+{
+	if(cams.empty()) return;
+
+	for(size_t i = 0; i < cams.size(); i++)
+	{
+		uint32_t seq = cams[i].next_seq;
+		collect(cams[i]);
+		if(staggered && i > 0 && cams[i].next_seq != seq && !cams[i].cam->isDelayingFrame())
+			measure_phase(cams[i]);
+	}
+
+	if(staggered)
+		rephase();
+	else
+		match();
+
+	// what is left waits for the other cameras, oldest first out
+	for(size_t i = 0; i < cams.size(); i++)
+	{
+		Member &m = cams[i];
+		while(m.pending.size() > max_pending)
+		{
+			m.pending.pop_front();
+			dropped_frames++;
+		}
+	}
+}
+
+bool CameraGroup::getFrameSet(FrameSet &set)
+{
+	update();
+
+	while(!ready.empty())
+	{
+		Match m = ready.front();
+		ready.pop_front();
+		if(resolve(m, set)) return true;
+		dropped_sets++;
+	}
+	return false;
+}
+
+/* The oldest pending frame goes out once no other camera can still
+ * deliver an earlier one: every camera has a frame pending, or its next
+ * frame is at least half a period away, or the frame has waited a full
+ * period behind the newest one. */
+bool CameraGroup::getFrame(size_t &camera, const uint8_t *&frame, FrameInfo &info)
+{
+	size_t i, first;
+	double t_first = 0, t_newest = 0;
+
+	update();
+
+	for(;;)
+	{
+		first = cams.size();
+		for(i = 0; i < cams.size(); i++)
+		{
+			if(cams[i].pending.empty()) continue;
+			double t = frame_time(cams[i].pending.front().info);
+			if(first == cams.size() || t < t_first) { first = i; t_first = t; }
+			t = frame_time(cams[i].pending.back().info);
+			if(t > t_newest) t_newest = t;
+		}
+		if(first == cams.size()) return false;
+
+		for(i = 0; i < cams.size() && t_newest - t_first < period; i++)
+		{
+			const Member &m = cams[i];
+			if(m.pending.empty() && m.last_time != 0 && t_first > m.last_time + period / 2)
+				return false;
+		}
+
+		Member &m = cams[first];
+		uint32_t seq = m.pending.front().sequence;
+		m.pending.pop_front();
+		frame = m.cam->getFramePointer(seq, &info);
+		if(frame != NULL)
+		{
+			camera = first;
+			return true;
+		}
+		dropped_frames++;
+	}
+}
+
+} // namespace
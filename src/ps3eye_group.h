@@ -0,0 +1,151 @@
+#ifndef PS3EYE_GROUP_H
+#define PS3EYE_GROUP_H
+
+#include "ps3eye.h"
+
+#include <deque>
+
+namespace ps3eye {
+
+// one frame of every camera of a group, in the order the cameras were added
+struct FrameSet
+{
+	std::vector<const uint8_t*> frames;	// raw ring frames, see PS3EYECam::getFramePointer()
+	std::vector<FrameInfo> info;
+	double timestamp;					// mean of the frame times
+	double spread;						// newest minus oldest frame time
+};
+
+enum GroupClock
+{
+	GROUP_CLOCK_HOST = 0,	// FrameInfo::timestamp, arrival on the host
+	GROUP_CLOCK_DEVICE		// FrameInfo::device_time, pts mapped to the host clock
+};
+
+enum GroupDropPolicy
+{
+	GROUP_DROP_OLDEST = 0,	// keep the newest sets, lowest latency
+	GROUP_DROP_NEWEST		// keep the oldest sets, no gaps while the reader keeps up
+};
+
+/* Matches the frames of several cameras by timestamp. Frames are not
+ * copied: a set points into the frame rings of the cameras and is valid
+ * until the next PS3EYECam::updateDevices(). Sets whose frames were
+ * overwritten before being read are dropped.
+ *
+ *	group.addCamera(cam0); group.addCamera(cam1);
+ *	...
+ *	PS3EYECam::updateDevices();
+ *	while(group.getFrameSet(set)) { ... }
+ *
+ * A staggered group instead spreads the frame phases of N cameras running
+ * the same mode evenly over one frame period and merges their frames into
+ * one time ordered stream at N times the rate:
+ *
+ *	group.startStaggered();
+ *	...
+ *	PS3EYECam::updateDevices();
+ *	while(group.getFrame(index, frame, info)) { ... }
+ */
+class CameraGroup
+{
+public:
+	CameraGroup();
+
+	// cameras can be added before or after they are started
+	void addCamera(PS3EYECam::PS3EYERef cam);
+	size_t size() const { return cams.size(); }
+	PS3EYECam::PS3EYERef getCamera(size_t i) const { return cams[i].cam; }
+
+	// frames further apart than this are never matched, 0 (default) is
+	// half the frame period of the slowest camera
+	void setWindow(double seconds) { window = seconds; }
+	double getWindow() const;
+	// which frame time is matched, GROUP_CLOCK_HOST by default
+	void setClock(GroupClock clock) { time_source = clock; }
+	// unmatched frames kept per camera, at most 14
+	void setMaxPending(uint32_t frames);
+	// matched sets kept until read, and which ones go when that is exceeded
+	void setMaxSets(uint32_t sets, GroupDropPolicy policy = GROUP_DROP_OLDEST);
+
+	// start() all cameras, frames are matched into sets
+	void start();
+	// Start the cameras with camera i at i/N of a frame period after camera
+	// 0. The cameras must run at the same rate. Phases are then measured
+	// from the frame times and corrected with PS3EYECam::delayFrame()
+	// whenever one is off by more than the phase tolerance.
+	bool startStaggered();
+	void stop();
+	bool isStaggered() const { return staggered; }
+	// allowed phase error as a fraction of the frame period, default 0.05
+	void setPhaseTolerance(double periods) { phase_tolerance = periods; }
+	// measured phase of camera i after camera 0 in periods, -1 if unknown
+	double getPhase(size_t i) const;
+	// phase corrections made so far
+	uint32_t getRephaseCount() const { return rephase_count; }
+
+	// collect new frames and match them (or correct the phases of a
+	// staggered group), getFrameSet() and getFrame() call this
+	void update();
+	// oldest matched set, false if none is ready
+	bool getFrameSet(FrameSet &set);
+	size_t getReadyCount() const { return ready.size(); }
+	// next frame of a staggered group in time order, false if none is due
+	bool getFrame(size_t &camera, const uint8_t *&frame, FrameInfo &info);
+
+	// frames that were never part of a set
+	uint64_t getDroppedFrames() const { return dropped_frames; }
+	// matched sets that were discarded by the drop policy or overwritten
+	uint64_t getDroppedSets() const { return dropped_sets; }
+
+private:
+	struct Pending
+	{
+		uint32_t sequence;
+		FrameInfo info;
+	};
+	struct Member
+	{
+		PS3EYECam::PS3EYERef cam;
+		uint32_t next_seq;		// next sequence to collect
+		std::deque<Pending> pending;
+		double last_time;		// newest collected frame, group clock
+		double last_device_time;	// the same frame, device time, for the phase
+		// phase after camera 0 as a smoothed unit vector
+		double phase_x, phase_y;
+		uint32_t phase_samples;
+	};
+
+	// sequences of one set, in camera order
+	struct Match
+	{
+		std::vector<uint32_t> seq;
+	};
+
+	double frame_time(const FrameInfo &info) const;
+	void collect(Member &m);
+	void match();
+	void measure_phase(Member &m);
+	void rephase();
+	bool resolve(const Match &match, FrameSet &set) const;
+
+	std::vector<Member> cams;
+	std::deque<Match> ready;
+	double window;
+	GroupClock time_source;
+	uint32_t max_pending;
+	uint32_t max_sets;
+	GroupDropPolicy drop_policy;
+	uint64_t dropped_frames;
+	uint64_t dropped_sets;
+
+	bool staggered;
+	double period;
+	double phase_tolerance;
+	double last_rephase;
+	uint32_t rephase_count;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,248 @@
+#include "ps3eye_hdr.h"
+#include "ps3eye_simd.h"
+#include "ps3eye_parallel.h"
+
+#include <algorithm>
+
+namespace ps3eye {
+
+#define RADIANCE_SHIFT	5
+#define WEIGHT_ONE		32767
+
+HDRMerge::HDRMerge()
+{
+	num_frames = 0;
+	key = 0;
+	auto_key = 0;
+	last_seq = 0;
+	has_seq = false;
+	setSaturation(220, 250);
+}
+
+void HDRMerge::setSaturation(uint8_t low, uint8_t high)
+{
+	if (high <= low) {
+		if (low == 255) low = 254;
+		high = low + 1;
+	}
+	t_high = high;
+	span = high - low;
+	slope = WEIGHT_ONE / span;
+}
+
+void HDRMerge::setKey(float levels)
+{
+	float k = levels * (1 << RADIANCE_SHIFT);
+	key = (int16_t)(k <= 0 ? 0 : (k < 1 ? 1 : (k > 8191 ? 8191 : k + 0.5f)));
+}
+
+float HDRMerge::getKey() const
+{
+	return (float)(key ? key : auto_key) / (1 << RADIANCE_SHIFT);
+}
+
+float HDRMerge::exposureFactor(const CaptureSettings &settings)
+{
+	float e = settings.exposure ? settings.exposure : 1;
+	return e * (1 + (settings.gain & 15) / 16.0f) * (1 << ((settings.gain >> 4) & 3));
+}
+
+// weight of a longer exposure, full below the ramp and 0 above it
+static inline int ramp(int v, int t_high, int span, int slope)
+{
+	int e = t_high - v;
+	if (e <= 0) return 0;
+	return e >= span ? WEIGHT_ONE : e * slope;
+}
+
+static inline int mulhi(int a, int b) { return (int16_t)a * b >> 16; }
+
+// r << 8 / d in 8 restoring steps, r < d
+static inline int tone_div(int r, int d)
+{
+	int q = 0;
+	for (int i = 0; i < 8; i++) {
+		r <<= 1;
+		int ge = r >= d;
+		r -= ge ? d : 0;
+		q = (q << 1) | ge;
+	}
+	return q;
+}
+
+void HDRMerge::merge_rows(const uint8_t *const *src, int stride, uint32_t width, bool yuyv,
+						  uint8_t *dst, int dst_stride, int begin, int end)
+{
+	const uint32_t n = num_frames, step = yuyv ? 2 : 1;
+	const int k = key ? key : auto_key;
+
+	for (int y = begin; y < end; y++) {
+		const uint8_t *rows[HDR_MAX_FRAMES];
+		for (uint32_t i = 0; i < n; i++) rows[i] = src[i] + y * stride;
+		uint8_t *out = dst + y * dst_stride;
+		uint32_t x = 0, sum = 0;
+
+#if PS3EYE_SIMD
+		const vec lo8 = v_set16(0xff), one = v_set16(1), full = v_set16(WEIGHT_ONE);
+		const vec vhigh = v_set16(t_high), vspan = v_set16(span), spanm1 = v_set16(span - 1);
+		const vec vslope = v_set16(slope), vkey = v_set16((int16_t)k);
+		const vec c128 = v_set16(128 << RADIANCE_SHIFT), cround = v_set16(1 << (RADIANCE_SHIFT - 1));
+		vec acc = v_zero();
+		uint32_t acc_n = 0;
+
+		for (; x + PS3EYE_SIMD_WIDTH <= width * step; x += PS3EYE_SIMD_WIDTH) {
+			/* 16 bit lanes: a pixel each, Y in the low byte and U or V in
+			 * the high byte for YUYV, or the two halves of 8 bit samples */
+			vec res[2];
+			for (int half = 0; half < (yuyv ? 1 : 2); half++) {
+				vec r = v_zero(), c = v_zero();
+				for (uint32_t i = 0; i < n; i++) {
+					vec a = v_load(rows[i] + x), v, ci = v_zero();
+					if (yuyv) {
+						v = v_and(a, lo8);
+						ci = v_sub16(v_slli16(v_srli16(a, 8), RADIANCE_SHIFT), c128);
+					} else {
+						v = half ? v_widen_hi(a) : v_widen_lo(a);
+					}
+					vec ri = v_mulhi16(v_slli16(v, 7), v_set16(mult[i]));
+					if (i == 0) {
+						r = ri;
+						c = ci;
+						continue;
+					}
+					vec e = v_min16(v_max16(v_sub16(vhigh, v), v_zero()), vspan);
+					vec w = v_select(v_gt16(e, spanm1), full, v_mullo16(e, vslope));
+					r = v_add16(r, v_mulhi16(v_slli16(v_sub16(ri, r), 1), w));
+					if (yuyv) c = v_add16(c, v_mulhi16(v_slli16(v_sub16(ci, c), 1), w));
+				}
+				acc = v_add16(acc, v_srli16(r, RADIANCE_SHIFT));
+
+				// r << 8 / (r + key)
+				vec d = v_add16(r, vkey), q = v_zero();
+				for (int b = 0; b < 8; b++) {
+					r = v_slli16(r, 1);
+					vec lt = v_gt16(d, r);
+					r = v_sub16(r, v_andnot(d, lt));
+					q = v_add16(v_slli16(q, 1), v_andnot(one, lt));
+				}
+				if (yuyv) {
+					c = v_srai16(v_add16(v_add16(c, c128), cround), RADIANCE_SHIFT);
+					q = v_or(q, v_slli16(c, 8));
+				}
+				res[half] = q;
+			}
+			v_store(out + x, yuyv ? res[0] : v_pack16(res[0], res[1]));
+
+			// lanes hold at most 255 each, flush before they can overflow
+			if (++acc_n == (yuyv ? 128u : 64u) || x + 2 * PS3EYE_SIMD_WIDTH > width * step) {
+				int16_t lanes[PS3EYE_SIMD_WIDTH / 2];
+				v_store(lanes, acc);
+				for (int l = 0; l < PS3EYE_SIMD_WIDTH / 2; l++) sum += (uint16_t)lanes[l];
+				acc = v_zero();
+				acc_n = 0;
+			}
+		}
+#endif
+
+		for (; x < width * step; x += step) {
+			int r = 0, c = 0;
+			for (uint32_t i = 0; i < n; i++) {
+				int v = rows[i][x];
+				int ri = mulhi(v << 7, mult[i]);
+				int ci = yuyv ? (rows[i][x + 1] - 128) << RADIANCE_SHIFT : 0;
+				if (i == 0) {
+					r = ri;
+					c = ci;
+					continue;
+				}
+				int w = ramp(v, t_high, span, slope);
+				r += mulhi((ri - r) << 1, w);
+				c += mulhi((ci - c) << 1, w);
+			}
+			sum += r >> RADIANCE_SHIFT;
+			out[x] = (uint8_t)tone_div(r, r + k);
+			if (yuyv)
+				out[x + 1] = (uint8_t)((c + (128 << RADIANCE_SHIFT) + (1 << (RADIANCE_SHIFT - 1))) >> RADIANCE_SHIFT);
+		}
+		row_sums[y] = sum;
+	}
+}
+
+bool HDRMerge::merge(const uint8_t *const *frames, const float *exposures, uint32_t count,
+					 int stride, uint32_t width, uint32_t height, PixelInput input,
+					 uint8_t *dst, int dstStride)
+{
+	if (count == 0 || count > HDR_MAX_FRAMES || width == 0 || height == 0)
+		return false;
+
+	// shortest exposure first
+	uint32_t order[HDR_MAX_FRAMES];
+	for (uint32_t i = 0; i < count; i++) {
+		if (!(exposures[i] > 0) || frames[i] == NULL) return false;
+		order[i] = i;
+	}
+	std::sort(order, order + count, [=](uint32_t a, uint32_t b) { return exposures[a] < exposures[b]; });
+
+	const uint8_t *src[HDR_MAX_FRAMES];
+	float shortest = exposures[order[0]];
+	for (uint32_t i = 0; i < count; i++) {
+		src[i] = frames[order[i]];
+		float m = 16384 * shortest / exposures[order[i]];
+		mult[i] = (int16_t)(m < 1 ? 1 : m + 0.5f);
+	}
+	num_frames = count;
+	row_sums.resize(height);
+
+	bool yuyv = input == INPUT_YUYV;
+	// without a previous merge the auto key comes from a first pass
+	int passes = key || auto_key ? 1 : 2;
+	if (passes == 2) auto_key = 1;
+	for (int p = 0; p < passes; p++) {
+		parallel_rows(height, 16, [&](int begin, int end) {
+			merge_rows(src, stride, width, yuyv, dst, dstStride, begin, end);
+		});
+
+		uint64_t sum = 0;
+		for (uint32_t y = 0; y < height; y++) sum += row_sums[y];
+		uint64_t mean = ((sum << RADIANCE_SHIFT) + (uint64_t)width * height / 2) / ((uint64_t)width * height);
+		if (!key) auto_key = (int16_t)(std::max)(mean, (uint64_t)1);
+	}
+	return true;
+}
+
+bool HDRMerge::update(const PS3EYECam &cam)
+{
+	uint32_t steps = (uint32_t)cam.getBracketing().size();
+	uint32_t count = cam.getFrameCount();
+	if (steps == 0 || steps > HDR_MAX_FRAMES || count < steps)
+		return false;
+
+	// newest frame that ends a cycle, within the ring
+	for (uint32_t last = count - 1; count - last <= 15 && last + 1 >= steps; last--) {
+		uint32_t first = last + 1 - steps;
+		if (has_seq && (int32_t)(first - last_seq) <= 0)
+			return false;
+
+		const uint8_t *frames[HDR_MAX_FRAMES];
+		float exposures[HDR_MAX_FRAMES];
+		FrameInfo info;
+		uint32_t i = 0;
+		for (; i < steps; i++) {
+			frames[i] = cam.getFramePointer(first + i, &info);
+			if (frames[i] == NULL || info.bracket != (int16_t)i) break;
+			exposures[i] = exposureFactor(info.settings);
+		}
+		if (i < steps) continue;
+
+		PixelInput input = pixelInput(info.format);
+		uint32_t w = cam.getWidth(), h = cam.getHeight(), stride = w * inputBytes(input);
+		frame.resize(stride * h);
+		merge(frames, exposures, steps, stride, w, h, input, &frame[0], stride);
+		last_seq = first;
+		has_seq = true;
+		return true;
+	}
+	return false;
+}
+
+} // namespace
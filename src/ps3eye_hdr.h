@@ -0,0 +1,76 @@
+#ifndef PS3EYE_HDR_H
+#define PS3EYE_HDR_H
+
+#include "ps3eye_input.h"
+
+#include <vector>
+
+namespace ps3eye {
+
+#define HDR_MAX_FRAMES	8
+
+/* Merges frames of a still scene taken with different exposures into
+ * one tone mapped frame of the input format.
+ *
+ * Each frame is scaled to a common radiance by its relative exposure
+ * (see exposureFactor()), with 5 fractional bits over the levels of the
+ * shortest exposure. Starting from the shortest, every longer exposure
+ * replaces the radiance where it is below the saturation ramp and fades
+ * out across it, so each pixel ends up from the longest exposure that
+ * still had room. Reinhard's r / (r + key) then maps the radiance back
+ * to 8 bits, the key landing on mid grey. The chroma of YUYV frames
+ * follows the weights of the luma.
+ *
+ *	cam->setBracketing(steps);	// e.g. exposures 30, 120, 255
+ *	...
+ *	if (hdr.update(*cam))
+ *		show(hdr.getFrame());
+ *
+ * Exposure ratios beyond 32 lose precision in the long exposures. */
+class HDRMerge
+{
+public:
+	HDRMerge();
+
+	// luma where a longer exposure starts to fade out and where it is
+	// ignored, defaults 220 and 250
+	void setSaturation(uint8_t low, uint8_t high);
+	// radiance mapped to mid grey, in levels of the shortest exposure;
+	// 0 (default) follows the mean of the previous merge
+	void setKey(float levels);
+	float getKey() const;
+
+	// light gathered with the settings relative to exposure 1 at gain 0
+	static float exposureFactor(const CaptureSettings &settings);
+
+	// merge count frames of the same size and format, exposures in any order
+	bool merge(const uint8_t *const *frames, const float *exposures, uint32_t count,
+			   int stride, uint32_t width, uint32_t height, PixelInput input,
+			   uint8_t *dst, int dstStride);
+	// merge the newest complete bracketing cycle of the camera (frames with
+	// FrameInfo::bracket 0 .. n-1 in a row) if it was not merged yet
+	bool update(const PS3EYECam &cam);
+	// first sequence of the cycle last merged by update()
+	uint32_t getSequence() const { return last_seq; }
+	// result of update(), width x height in the input format
+	const uint8_t* getFrame() const { return frame.empty() ? NULL : &frame[0]; }
+
+private:
+	void merge_rows(const uint8_t *const *src, int stride, uint32_t width, bool yuyv,
+					uint8_t *dst, int dst_stride, int begin, int end);
+
+	uint32_t num_frames;
+	int16_t mult[HDR_MAX_FRAMES];	// radiance per level << 7, 1/65536 units
+	int16_t t_high, span, slope;	// weight ramp, 1/32768 units
+	int16_t key;					// 0 for auto
+	int16_t auto_key;				// mean radiance of the last merge, 0 before
+	std::vector<uint32_t> row_sums;
+
+	std::vector<uint8_t> frame;
+	uint32_t last_seq;
+	bool has_seq;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,189 @@
+#include "ps3eye_hsv.h"
+#include "ps3eye_simd.h"
+#include "ps3eye_parallel.h"
+
+namespace ps3eye {
+
+/* Fixed point BT.601 video range with 6 fractional bits:
+ *	R = (75 (Y - 16) + 102 (V - 128) + 32) >> 6
+ *	G = (75 (Y - 16) - 25 (U - 128) - 52 (V - 128) + 32) >> 6
+ *	B = (75 (Y - 16) + 129 (U - 128) + 32) >> 6
+ * The chroma terms are computed once per macropixel. Divisions in the
+ * HSV step are exact integer divisions, rounded, so the vector code can
+ * do them bit by bit and still match the scalar code. */
+
+#define Y_SCALE		75
+#define V_TO_R		102
+#define U_TO_G		25
+#define V_TO_G		52
+#define U_TO_B		129
+
+int hsvOutputBytes(HSVOutput output)
+{
+	return output == HSV_HS ? 2 : 3;
+}
+
+static inline int clamp8(int v) { return v < 0 ? 0 : (v > 255 ? 255 : v); }
+
+static inline void hsv_pixel(int y, int rv, int guv, int bu, uint8_t *dst, HSVOutput output)
+{
+	int yt = Y_SCALE * (y - 16) + 32;
+	int r = clamp8((yt + rv) >> 6);
+	int g = clamp8((yt - guv) >> 6);
+	int b = clamp8((yt + bu) >> 6);
+
+	int v = r > g ? (r > b ? r : b) : (g > b ? g : b);
+	int m = r < g ? (r < b ? r : b) : (g < b ? g : b);
+	int d = v - m;
+	int h = 0, s = 0;
+
+	if (d > 0) {
+		int diff, off;
+		if (v == r) { diff = g - b; off = 0; }
+		else if (v == g) { diff = b - r; off = 60; }
+		else { diff = r - g; off = 120; }
+		int q = (30 * (diff < 0 ? -diff : diff) + (d >> 1)) / d;
+		h = off + (diff < 0 ? -q : q);
+		if (h < 0) h += 180;
+		s = (255 * d + (v >> 1)) / v;
+	}
+
+	dst[0] = (uint8_t)h;
+	dst[1] = (uint8_t)s;
+	if (output == HSV_HSV) dst[2] = (uint8_t)v;
+}
+
+void yuvToHSV(uint8_t y, uint8_t u, uint8_t v, uint8_t &h, uint8_t &s, uint8_t &val)
+{
+	uint8_t hsv[3];
+	int du = u - 128, dv = v - 128;
+	hsv_pixel(y, V_TO_R * dv, U_TO_G * du + V_TO_G * dv, U_TO_B * du, hsv, HSV_HSV);
+	h = hsv[0];
+	s = hsv[1];
+	val = hsv[2];
+}
+
+#if PS3EYE_SIMD
+
+// rounded n / d for quotients below 2^BITS, one restoring division step
+// per bit with the remainder kept below 2d so signed compares work
+template <int BITS> static inline vec div_bits(vec n, vec d)
+{
+	const vec one = v_set16(1);
+	vec r = v_srli16(n, BITS);
+	vec t = v_slli16(n, 16 - BITS);
+	vec q = v_zero();
+
+	for (int i = 0; i < BITS; i++) {
+		r = v_or(v_slli16(r, 1), v_srli16(t, 15));
+		t = v_slli16(t, 1);
+		vec ge = v_xor(v_gt16(d, r), v_set16(-1));
+		r = v_sub16(r, v_and(d, ge));
+		q = v_or(v_slli16(q, 1), v_and(ge, one));
+	}
+	return q;
+}
+
+static inline vec clamp16(vec v)
+{
+	return v_max16(v_min16(v, v_set16(255)), v_zero());
+}
+
+// H, S, V of 16 bit R, G, B lanes
+static inline void hsv_lanes(vec r, vec g, vec b, vec &h, vec &s, vec &v)
+{
+	const vec zero = v_zero();
+
+	v = v_max16(r, v_max16(g, b));
+	vec m = v_min16(r, v_min16(g, b));
+	vec d = v_sub16(v, m);
+	vec nz = v_gt16(d, zero);
+
+	// sector of the maximum, red before green before blue as in the scalar code
+	vec not_r = v_gt16(v, r);
+	vec is_g = v_andnot(not_r, v_gt16(v, g));
+	vec is_b = v_andnot(not_r, is_g);
+	vec diff = v_select(not_r, v_select(is_g, v_sub16(b, r), v_sub16(r, g)), v_sub16(g, b));
+	vec off = v_or(v_and(is_g, v_set16(60)), v_and(is_b, v_set16(120)));
+
+	// d is 0 only where v == m, the quotients are masked out there
+	vec neg = v_gt16(zero, diff);
+	vec half = v_srli16(d, 1);
+	vec q = div_bits<5>(v_add16(v_mullo16(v_abs16(diff), v_set16(30)), half), d);
+	h = v_add16(off, v_select(neg, v_sub16(zero, q), q));
+	h = v_add16(h, v_and(v_gt16(zero, h), v_set16(180)));
+	h = v_and(h, nz);
+
+	s = div_bits<8>(v_add16(v_mullo16(d, v_set16(255)), v_srli16(v, 1)), v);
+	s = v_and(s, nz);
+}
+
+#endif
+
+static void hsv_row(const uint8_t *src, uint8_t *dst, int width, HSVOutput output)
+{
+	const int bpp = hsvOutputBytes(output);
+	int x = 0;
+
+#if PS3EYE_SIMD
+	const vec low = v_set16(0x00ff), c128 = v_set16(128);
+	const vec y_off = v_set16(16), y_scale = v_set16(Y_SCALE), round = v_set16(32);
+
+	for (; x + PS3EYE_SIMD_WIDTH <= width; x += PS3EYE_SIMD_WIDTH, src += 2 * PS3EYE_SIMD_WIDTH) {
+		vec a = v_load(src), b = v_load(src + PS3EYE_SIMD_WIDTH);
+		// one lane per macropixel, U low byte and V high byte
+		vec uv = v_pack16(v_srli16(a, 8), v_srli16(b, 8));
+		vec du = v_sub16(v_and(uv, low), c128);
+		vec dv = v_sub16(v_srli16(uv, 8), c128);
+		vec rv[2], guv[2], bu[2];
+		v_zip16(v_mullo16(dv, v_set16(V_TO_R)), v_mullo16(dv, v_set16(V_TO_R)), rv[0], rv[1]);
+		vec t = v_add16(v_mullo16(du, v_set16(U_TO_G)), v_mullo16(dv, v_set16(V_TO_G)));
+		v_zip16(t, t, guv[0], guv[1]);
+		t = v_mullo16(du, v_set16(U_TO_B));
+		v_zip16(t, t, bu[0], bu[1]);
+
+		// a and b hold the lumas of the first and second half as 16 bit lanes
+		vec h[2], s[2], v[2];
+		for (int i = 0; i < 2; i++) {
+			vec yt = v_add16(v_mullo16(v_sub16(v_and(i ? b : a, low), y_off), y_scale), round);
+			vec r = clamp16(v_srai16(v_adds16(yt, rv[i]), 6));
+			vec g = clamp16(v_srai16(v_sub16(yt, guv[i]), 6));
+			vec bl = clamp16(v_srai16(v_adds16(yt, bu[i]), 6));
+			hsv_lanes(r, g, bl, h[i], s[i], v[i]);
+		}
+
+		vec h8 = v_pack16(h[0], h[1]), s8 = v_pack16(s[0], s[1]);
+		uint8_t *out = dst + x * bpp;
+		if (output == HSV_HS) {
+			vec lo, hi;
+			v_zip8(h8, s8, lo, hi);
+			v_store(out, lo);
+			v_store(out + PS3EYE_SIMD_WIDTH, hi);
+		} else {
+			uint8_t ph[PS3EYE_SIMD_WIDTH], ps[PS3EYE_SIMD_WIDTH], pv[PS3EYE_SIMD_WIDTH];
+			v_store(ph, h8); v_store(ps, s8); v_store(pv, v_pack16(v[0], v[1]));
+			for (int i = 0; i < PS3EYE_SIMD_WIDTH; i++, out += 3) {
+				out[0] = ph[i]; out[1] = ps[i]; out[2] = pv[i];
+			}
+		}
+	}
+#endif
+
+	for (; x < width; x += 2, src += 4) {
+		int du = src[1] - 128, dv = src[3] - 128;
+		int rv = V_TO_R * dv, guv = U_TO_G * du + V_TO_G * dv, bu = U_TO_B * du;
+		hsv_pixel(src[0], rv, guv, bu, dst + x * bpp, output);
+		if (x + 1 < width) hsv_pixel(src[2], rv, guv, bu, dst + (x + 1) * bpp, output);
+	}
+}
+
+void yuyvToHSV(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+			   int width, int height, HSVOutput output)
+{
+	parallel_rows(height, 16, [=](int begin, int end) {
+		for (int y = begin; y < end; y++)
+			hsv_row(src + y * src_stride, dst + y * dst_stride, width, output);
+	});
+}
+
+} // namespace
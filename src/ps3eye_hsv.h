@@ -0,0 +1,28 @@
+#ifndef PS3EYE_HSV_H
+#define PS3EYE_HSV_H
+
+#include <stdint.h>
+
+namespace ps3eye {
+
+enum HSVOutput
+{
+	HSV_HSV = 0,	// 3 bytes per pixel: H, S, V
+	HSV_HS			// 2 bytes per pixel: H, S, for hue/saturation trackers
+};
+
+// bytes per output pixel of a conversion
+int hsvOutputBytes(HSVOutput output);
+
+// Convert YUYV (BT.601 video range) straight to 8 bit HSV without an RGB
+// pass. H is in 2 degree steps, 0..179, S and V are 0..255, the same
+// scaling as OpenCV's 8 bit HSV. Rows are split over the worker threads.
+void yuyvToHSV(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+			   int width, int height, HSVOutput output = HSV_HSV);
+
+// one color with the same integer math as yuyvToHSV()
+void yuvToHSV(uint8_t y, uint8_t u, uint8_t v, uint8_t &h, uint8_t &s, uint8_t &val);
+
+} // namespace
+
+#endif
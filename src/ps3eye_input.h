@@ -0,0 +1,58 @@
+#ifndef PS3EYE_INPUT_H
+#define PS3EYE_INPUT_H
+
+#include "ps3eye.h"
+
+namespace ps3eye {
+
+// pixel layout of the frames given to the processing modules
+enum PixelInput
+{
+	INPUT_YUYV = 0,	// 2 bytes per pixel, the modules work on the luma
+	INPUT_GRAY,		// 1 byte pixels (Y8, raw Bayer)
+	INPUT_MASK		// 1 byte class masks (see ps3eye_color.h), blob detector only
+};
+
+inline PixelInput pixelInput(FrameFormat format)
+{
+	return format == FORMAT_YUYV ? INPUT_YUYV : INPUT_GRAY;
+}
+
+inline uint32_t inputBytes(PixelInput input)
+{
+	return input == INPUT_YUYV ? 2 : 1;
+}
+
+/* The newest frame of a camera that was not handed out before, for the
+ * update() of the modules that work on one frame at a time. Frames that
+ * came and went between two calls are skipped. */
+class NewestFrame
+{
+public:
+	NewestFrame() : last_seq(0), has_seq(false) {}
+
+	// NULL if there is no new frame or it already left the ring
+	const uint8_t* next(const PS3EYECam &cam)
+	{
+		uint32_t count = cam.getFrameCount();
+		if (count == 0 || (has_seq && last_seq == count - 1)) return NULL;
+
+		const uint8_t *frame = cam.getFramePointer(count - 1);
+		if (frame == NULL) return NULL;
+		last_seq = count - 1;
+		has_seq = true;
+		return frame;
+	}
+	// sequence of the frame last handed out
+	uint32_t getSequence() const { return last_seq; }
+	// hand out the newest frame again, even if it was before
+	void reset() { has_seq = false; }
+
+private:
+	uint32_t last_seq;
+	bool has_seq;
+};
+
+} // namespace
+
+#endif
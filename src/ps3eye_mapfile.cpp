@@ -0,0 +1,75 @@
+#include "ps3eye_mapfile.h"
+
+#if defined(_WIN32)
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+namespace ps3eye {
+
+MappedFile::MappedFile()
+{
+	ptr = NULL;
+	len = 0;
+#if defined(_WIN32)
+	file = handle = NULL;
+#endif
+}
+
+bool MappedFile::open(const char *path)
+{
+	close();
+
+#if defined(_WIN32)
+	HANDLE f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (f == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER size;
+	HANDLE h = NULL;
+	void *p = NULL;
+	if (GetFileSizeEx(f, &size) && size.QuadPart > 0)
+		h = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (h != NULL)
+		p = MapViewOfFile(h, FILE_MAP_READ, 0, 0, 0);
+	if (p == NULL) {
+		if (h != NULL) CloseHandle(h);
+		CloseHandle(f);
+		return false;
+	}
+	file = f;
+	handle = h;
+	len = (size_t)size.QuadPart;
+#else
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	void *p = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED) return false;
+	len = (size_t)st.st_size;
+#endif
+	ptr = p;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (ptr == NULL) return;
+#if defined(_WIN32)
+	UnmapViewOfFile(ptr);
+	CloseHandle((HANDLE)handle);
+	CloseHandle((HANDLE)file);
+	file = handle = NULL;
+#else
+	munmap(ptr, len);
+#endif
+	ptr = NULL;
+	len = 0;
+}
+
+} // namespace
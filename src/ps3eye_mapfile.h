@@ -0,0 +1,37 @@
+#ifndef PS3EYE_MAPFILE_H
+#define PS3EYE_MAPFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace ps3eye {
+
+// Read only mapping of a whole file, for calibration data and tables
+// that are used in place instead of being read at startup.
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile() { close(); }
+
+	// false if the file is missing or empty
+	bool open(const char *path);
+	void close();
+
+	const uint8_t* data() const { return (const uint8_t*)ptr; }
+	size_t size() const { return len; }
+
+private:
+	MappedFile(const MappedFile&);
+	void operator=(const MappedFile&);
+
+	void *ptr;
+	size_t len;
+#if defined(_WIN32)
+	void *file, *handle;
+#endif
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,214 @@
+#include "ps3eye_motion.h"
+#include "ps3eye_simd.h"
+#include "ps3eye_parallel.h"
+
+#include <algorithm>
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+
+namespace ps3eye {
+
+static inline uint32_t popcount32(uint32_t v)
+{
+#if defined(_MSC_VER)
+	return (uint32_t)__popcnt(v);
+#else
+	return (uint32_t)__builtin_popcount(v);
+#endif
+}
+
+// set bits of [x0, x1) in a row
+static uint32_t count_bits(const uint32_t *bits, uint32_t x0, uint32_t x1)
+{
+	uint32_t n = 0;
+
+	while (x0 < x1) {
+		uint32_t i = x0 >> 5, lo = x0 & 31;
+		uint32_t hi = (std::min)(x1 - (x0 & ~31u), 32u);
+		uint32_t m = (hi == 32 ? ~0u : (1u << hi) - 1) & (~0u << lo);
+		n += popcount32(bits[i] & m);
+		x0 = (x0 & ~31u) + hi;
+	}
+	return n;
+}
+
+MotionDetector::MotionDetector()
+{
+	thresh = 20;
+	filter = MOTION_FILTER_NONE;
+	tile_w = tile_h = 16;
+	trigger = 8;
+	width = height = words = 0;
+	tiles_x = tiles_y = 0;
+	has_prev = false;
+	moved = false;
+	changed = 0;
+}
+
+bool MotionDetector::setTileSize(uint32_t w, uint32_t h)
+{
+	if (w == 0 || h == 0) return false;
+	tile_w = w;
+	tile_h = h;
+	// counts are resized on the next frame
+	width = 0;
+	return true;
+}
+
+void MotionDetector::reset()
+{
+	has_prev = false;
+	newest.reset();
+	moved = false;
+	changed = 0;
+}
+
+// difference, threshold and store the new plane for rows [begin, end)
+void MotionDetector::threshold_rows(const uint8_t *frame, int stride, PixelInput input, int begin, int end)
+{
+	for (int y = begin; y < end; y++) {
+		const uint8_t *row = frame + y * stride;
+		uint8_t *p = &prev[y * width];
+		uint32_t *bits = &raw[y * words];
+		uint32_t x = 0;
+
+		for (uint32_t i = 0; i < words; i++) bits[i] = 0;
+
+#if PS3EYE_SIMD
+		const vec vt = v_set8(thresh), luma = v_set16(0x00ff);
+
+		for (; x + PS3EYE_SIMD_WIDTH <= width; x += PS3EYE_SIMD_WIDTH) {
+			vec v;
+			if (input == INPUT_YUYV) {
+				vec a = v_load(row + 2 * x), b = v_load(row + 2 * x + PS3EYE_SIMD_WIDTH);
+				v = v_pack16(v_and(a, luma), v_and(b, luma));
+			} else {
+				v = v_load(row + x);
+			}
+			vec on = v_gt8(v_absdiff8(v, v_load(p + x)), vt);
+			v_store(p + x, v);
+			bits[x >> 5] |= v_movemask8(on) << (x & 31);
+		}
+#endif
+
+		for (; x < width; x++) {
+			uint8_t v = input == INPUT_YUYV ? row[2 * x] : row[x];
+			int d = v - p[x];
+			if (d > thresh || -d > thresh) bits[x >> 5] |= 1u << (x & 31);
+			p[x] = v;
+		}
+	}
+}
+
+// filter and count the rows of tile rows [begin, end)
+void MotionDetector::filter_tiles(int begin, int end)
+{
+	const uint32_t last = (width - 1) & 31, last_word = words - 1;
+	const uint32_t tail = last == 31 ? ~0u : (2u << last) - 1;
+
+	for (uint32_t ty = begin; ty < (uint32_t)end; ty++) {
+		uint32_t *tile = &counts[ty * tiles_x];
+		uint32_t y1 = (std::min)((ty + 1) * tile_h, height);
+
+		for (uint32_t tx = 0; tx < tiles_x; tx++) tile[tx] = 0;
+
+		for (uint32_t y = ty * tile_h; y < y1; y++) {
+			uint32_t *out = &mask[y * words];
+
+			if (filter == MOTION_FILTER_NONE) {
+				const uint32_t *in = &raw[y * words];
+				for (uint32_t i = 0; i < words; i++) out[i] = in[i];
+			} else {
+				// borders repeat the edge pixels
+				const uint32_t *up = &raw[(y > 0 ? y - 1 : y) * words];
+				const uint32_t *cur = &raw[y * words];
+				const uint32_t *down = &raw[(y + 1 < height ? y + 1 : y) * words];
+				bool erode = filter == MOTION_FILTER_ERODE;
+				uint32_t v, prev_v = 0, next_v;
+
+				v = erode ? up[0] & cur[0] & down[0] : up[0] | cur[0] | down[0];
+				for (uint32_t i = 0; i < words; i++) {
+					if (i < last_word) {
+						next_v = erode ? up[i + 1] & cur[i + 1] & down[i + 1]
+									   : up[i + 1] | cur[i + 1] | down[i + 1];
+					} else {
+						// the pixel past the end is the last pixel again
+						next_v = (v >> last) & 1;
+					}
+					uint32_t left = (v << 1) | (i > 0 ? prev_v >> 31 : v & 1);
+					uint32_t right = (v >> 1) | (next_v << (i < last_word ? 31 : last));
+					out[i] = erode ? v & left & right : v | left | right;
+					prev_v = v;
+					v = next_v;
+				}
+				out[last_word] &= tail;
+			}
+
+			for (uint32_t tx = 0; tx < tiles_x; tx++)
+				tile[tx] += count_bits(out, tx * tile_w, (std::min)((tx + 1) * tile_w, width));
+		}
+	}
+}
+
+bool MotionDetector::process(const uint8_t *frame, int stride, uint32_t w, uint32_t h, PixelInput input)
+{
+	if (w == 0 || h == 0) return false;
+
+	if (w != width || h != height) {
+		width = w;
+		height = h;
+		words = (w + 31) / 32;
+		tiles_x = (w + tile_w - 1) / tile_w;
+		tiles_y = (h + tile_h - 1) / tile_h;
+		prev.assign(w * h, 0);
+		raw.assign(words * h, 0);
+		mask.assign(words * h, 0);
+		counts.assign(tiles_x * tiles_y, 0);
+		has_prev = false;
+	}
+
+	parallel_rows(height, 32, [=](int begin, int end) {
+		threshold_rows(frame, stride, input, begin, end);
+	});
+
+	// the first frame only fills the previous plane
+	if (!has_prev) {
+		for (size_t i = 0; i < raw.size(); i++) raw[i] = 0;
+		has_prev = true;
+	}
+
+	parallel_rows(tiles_y, (32 + tile_h - 1) / tile_h, [=](int begin, int end) {
+		filter_tiles(begin, end);
+	});
+
+	moved = false;
+	changed = 0;
+	for (size_t i = 0; i < counts.size(); i++) {
+		changed += counts[i];
+		if (counts[i] >= trigger) moved = true;
+	}
+	return moved;
+}
+
+bool MotionDetector::update(const PS3EYECam &cam)
+{
+	const uint8_t *frame = newest.next(cam);
+	if (frame == NULL) return false;
+
+	PixelInput input = pixelInput(cam.getFormat());
+	process(frame, cam.getWidth() * inputBytes(input), cam.getWidth(), cam.getHeight(), input);
+	return true;
+}
+
+void MotionDetector::getMask(uint8_t *dst, int stride) const
+{
+	for (uint32_t y = 0; y < height; y++, dst += stride) {
+		const uint32_t *bits = &mask[y * words];
+		for (uint32_t x = 0; x < width; x++)
+			dst[x] = (bits[x >> 5] >> (x & 31)) & 1 ? 0xff : 0;
+	}
+}
+
+} // namespace
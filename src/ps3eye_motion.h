@@ -0,0 +1,88 @@
+#ifndef PS3EYE_MOTION_H
+#define PS3EYE_MOTION_H
+
+#include "ps3eye_input.h"
+
+#include <vector>
+
+namespace ps3eye {
+
+// 3x3 cleanup of the changed pixel mask
+enum MotionFilter
+{
+	MOTION_FILTER_NONE = 0,
+	MOTION_FILTER_ERODE,	// drop isolated noise pixels and thin edges
+	MOTION_FILTER_DILATE	// grow changed regions, closes small gaps
+};
+
+/* Frame differencing against the previous frame of one camera. A single
+ * pass over the frame takes the absolute difference to the stored
+ * previous Y plane, thresholds it into a bit mask and stores the new
+ * plane. The optional 3x3 filter and the per tile counts then run on the
+ * bit mask, which is 1/8 of a Y8 plane.
+ *
+ *	MotionDetector motion;
+ *	...
+ *	if (motion.update(*cam) && !motion.hasMotion())
+ *		continue;	// idle frame
+ *
+ * A frame has motion when any tile has at least the trigger count of
+ * changed pixels. The first frame after reset() or a size change has
+ * none. */
+class MotionDetector
+{
+public:
+	MotionDetector();
+
+	// pixels that changed by more than this are set, default 20
+	void setThreshold(uint8_t threshold) { thresh = threshold; }
+	void setFilter(MotionFilter f) { filter = f; }
+	// tiles of the counts, default 16x16
+	bool setTileSize(uint32_t w, uint32_t h);
+	// changed pixels in one tile that make a frame count as motion, default 8
+	void setTrigger(uint32_t pixels) { trigger = pixels; }
+	// forget the previous frame
+	void reset();
+
+	// compare a frame with the previous one, returns hasMotion()
+	bool process(const uint8_t *frame, int stride, uint32_t width, uint32_t height,
+				 PixelInput input = INPUT_YUYV);
+	// process the newest frame of the camera if it was not processed yet,
+	// false if there was none
+	bool update(const PS3EYECam &cam);
+	// sequence of the frame last processed by update()
+	uint32_t getSequence() const { return newest.getSequence(); }
+
+	bool hasMotion() const { return moved; }
+	uint32_t getChangedPixels() const { return changed; }
+	uint32_t getTilesX() const { return tiles_x; }
+	uint32_t getTilesY() const { return tiles_y; }
+	// changed pixels per tile, row major
+	const std::vector<uint32_t>& getTileCounts() const { return counts; }
+	// changed pixels as 0 / 255 bytes
+	void getMask(uint8_t *dst, int stride) const;
+
+private:
+	void threshold_rows(const uint8_t *frame, int stride, PixelInput input, int begin, int end);
+	void filter_tiles(int begin, int end);
+
+	uint8_t thresh;
+	MotionFilter filter;
+	uint32_t tile_w, tile_h;
+	uint32_t trigger;
+
+	uint32_t width, height, words;
+	uint32_t tiles_x, tiles_y;
+	std::vector<uint8_t> prev;		// Y plane of the previous frame
+	std::vector<uint32_t> raw;		// thresholded difference, 32 pixels per word
+	std::vector<uint32_t> mask;		// after the filter
+	std::vector<uint32_t> counts;
+	bool has_prev;
+	bool moved;
+	uint32_t changed;
+	NewestFrame newest;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,150 @@
+
+#include "ps3eye_parallel.h"
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace ps3eye {
+
+struct band_task
+{
+	band_func fn;
+	void *ctx;
+	int begin;
+	int end;
+	int *pending;
+};
+
+class WorkerPool
+{
+public:
+	WorkerPool() : quit(false) {}
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+
+	static WorkerPool& instance()
+	{
+		static WorkerPool pool;
+		return pool;
+	}
+
+	// grow the pool up to count - 1 workers (the caller is the last one)
+	void reserve(unsigned count)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		while (workers.size() + 1 < count)
+			workers.push_back(std::thread(&WorkerPool::run, this));
+	}
+
+	void execute(std::vector<band_task> &tasks)
+	{
+		int pending = (int)tasks.size() - 1;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (size_t i = 1; i < tasks.size(); i++) {
+				tasks[i].pending = &pending;
+				queue.push_back(tasks[i]);
+			}
+		}
+		wake.notify_all();
+
+		tasks[0].fn(tasks[0].ctx, tasks[0].begin, tasks[0].end);
+
+		// help with whatever is still queued, then wait for our bands
+		std::unique_lock<std::mutex> lock(mutex);
+		while (pending > 0) {
+			if (!queue.empty()) {
+				band_task t = queue.front();
+				queue.pop_front();
+				lock.unlock();
+				t.fn(t.ctx, t.begin, t.end);
+				lock.lock();
+				if (--(*t.pending) == 0)
+					done.notify_all();
+			} else {
+				done.wait(lock);
+			}
+		}
+	}
+
+private:
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			while (!quit && queue.empty())
+				wake.wait(lock);
+			if (quit)
+				return;
+			band_task t = queue.front();
+			queue.pop_front();
+			lock.unlock();
+			t.fn(t.ctx, t.begin, t.end);
+			lock.lock();
+			if (--(*t.pending) == 0)
+				done.notify_all();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::deque<band_task> queue;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	bool quit;
+};
+
+static unsigned worker_threads = 0;
+
+void setWorkerThreads(unsigned count)
+{
+	worker_threads = count;
+}
+
+unsigned getWorkerThreads()
+{
+	if (worker_threads == 0) {
+		unsigned n = std::thread::hardware_concurrency();
+		return n ? n : 1;
+	}
+	return worker_threads;
+}
+
+void parallel_rows(int rows, int min_band, band_func fn, void *ctx)
+{
+	int bands = (int)getWorkerThreads();
+	int i;
+
+	if (min_band < 1) min_band = 1;
+	if (bands > rows / min_band) bands = rows / min_band;
+	if (bands <= 1) {
+		if (rows > 0) fn(ctx, 0, rows);
+		return;
+	}
+
+	WorkerPool &pool = WorkerPool::instance();
+	pool.reserve(bands);
+
+	std::vector<band_task> tasks(bands);
+	for (i = 0; i < bands; i++) {
+		tasks[i].fn = fn;
+		tasks[i].ctx = ctx;
+		tasks[i].begin = (int)((long long)rows * i / bands);
+		tasks[i].end = (int)((long long)rows * (i + 1) / bands);
+		tasks[i].pending = NULL;
+	}
+	pool.execute(tasks);
+}
+
+} // namespace
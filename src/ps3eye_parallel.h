@@ -0,0 +1,31 @@
+#ifndef PS3EYE_PARALLEL_H
+#define PS3EYE_PARALLEL_H
+
+// Row band parallelism shared by the image processing stages. A single
+// pool of worker threads is started on first use and split between all
+// cameras; the calling thread always works on one of the bands itself.
+
+namespace ps3eye {
+
+// number of threads used per call, including the caller. 0 picks one per core.
+void setWorkerThreads(unsigned count);
+unsigned getWorkerThreads();
+
+typedef void (*band_func)(void *ctx, int begin, int end);
+
+// run fn over [0, rows) split in bands of at least min_band rows
+void parallel_rows(int rows, int min_band, band_func fn, void *ctx);
+
+template <class F> static void parallel_rows_thunk(void *ctx, int begin, int end)
+{
+	(*static_cast<F*>(ctx))(begin, end);
+}
+
+template <class F> inline void parallel_rows(int rows, int min_band, F fn)
+{
+	parallel_rows(rows, min_band, &parallel_rows_thunk<F>, &fn);
+}
+
+} // namespace
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef PS3EYE_SIMD_H
+#define PS3EYE_SIMD_H
+
+// Small portable layer over the vector units used by the image processing
+// stages. The widest instruction set enabled at compile time is used:
+// AVX2 (-mavx2), SSE2 (any x86-64) or NEON. Without any of them
+// PS3EYE_SIMD is 0 and the stages run their scalar code only, which can
+// also be forced by defining PS3EYE_NO_SIMD.
+//
+// All vectors hold PS3EYE_SIMD_WIDTH bytes. 16 bit operations work on the
+// same registers, with lanes in memory order (AVX2 lane crossing is fixed
+// up in widen/pack/zip so kernels can ignore it).
+
+#include <stdint.h>
+
+#if defined(PS3EYE_NO_SIMD)
+	#define PS3EYE_SIMD 0
+	#define PS3EYE_SIMD_WIDTH 1
+#elif defined(__AVX2__)
+	#include <immintrin.h>
+	#define PS3EYE_SIMD 1
+	#define PS3EYE_SIMD_AVX2 1
+	#define PS3EYE_SIMD_WIDTH 32
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define PS3EYE_SIMD 1
+	#define PS3EYE_SIMD_SSE2 1
+	#define PS3EYE_SIMD_WIDTH 16
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#include <arm_neon.h>
+	#define PS3EYE_SIMD 1
+	#define PS3EYE_SIMD_NEON 1
+	#define PS3EYE_SIMD_WIDTH 16
+#else
+	#define PS3EYE_SIMD 0
+	#define PS3EYE_SIMD_WIDTH 1
+#endif
+
+namespace ps3eye {
+
+#if PS3EYE_SIMD_AVX2
+
+typedef __m256i vec;
+
+static inline vec v_load(const void *p) { return _mm256_loadu_si256((const __m256i*)p); }
+static inline void v_store(void *p, vec a) { _mm256_storeu_si256((__m256i*)p, a); }
+static inline vec v_zero() { return _mm256_setzero_si256(); }
+static inline vec v_set8(uint8_t v) { return _mm256_set1_epi8((char)v); }
+static inline vec v_set16(int16_t v) { return _mm256_set1_epi16(v); }
+
+static inline vec v_and(vec a, vec b) { return _mm256_and_si256(a, b); }
+static inline vec v_or(vec a, vec b) { return _mm256_or_si256(a, b); }
+static inline vec v_xor(vec a, vec b) { return _mm256_xor_si256(a, b); }
+static inline vec v_andnot(vec a, vec b) { return _mm256_andnot_si256(b, a); } // a & ~b
+
+static inline vec v_avg8(vec a, vec b) { return _mm256_avg_epu8(a, b); }
+static inline vec v_min8(vec a, vec b) { return _mm256_min_epu8(a, b); }
+static inline vec v_max8(vec a, vec b) { return _mm256_max_epu8(a, b); }
+static inline vec v_adds8(vec a, vec b) { return _mm256_adds_epu8(a, b); }
+static inline vec v_subs8(vec a, vec b) { return _mm256_subs_epu8(a, b); }
+static inline vec v_eq8(vec a, vec b) { return _mm256_cmpeq_epi8(a, b); }
+static inline uint32_t v_movemask8(vec a) { return (uint32_t)_mm256_movemask_epi8(a); }
+
+static inline vec v_add16(vec a, vec b) { return _mm256_add_epi16(a, b); }
+static inline vec v_adds16(vec a, vec b) { return _mm256_adds_epi16(a, b); }
+static inline vec v_sub16(vec a, vec b) { return _mm256_sub_epi16(a, b); }
+static inline vec v_mullo16(vec a, vec b) { return _mm256_mullo_epi16(a, b); }
+static inline vec v_mulhi16(vec a, vec b) { return _mm256_mulhi_epi16(a, b); }
+static inline vec v_min16(vec a, vec b) { return _mm256_min_epi16(a, b); }
+static inline vec v_max16(vec a, vec b) { return _mm256_max_epi16(a, b); }
+static inline vec v_gt16(vec a, vec b) { return _mm256_cmpgt_epi16(a, b); }
+#define v_srli16(a, n) _mm256_srli_epi16(a, n)
+#define v_srai16(a, n) _mm256_srai_epi16(a, n)
+#define v_slli16(a, n) _mm256_slli_epi16(a, n)
+
+static inline vec v_widen_lo(vec a) { return _mm256_cvtepu8_epi16(_mm256_castsi256_si128(a)); }
+static inline vec v_widen_hi(vec a) { return _mm256_cvtepu8_epi16(_mm256_extracti128_si256(a, 1)); }
+static inline vec v_pack16(vec lo, vec hi) { return _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8); }
+static inline void v_zip8(vec a, vec b, vec &lo, vec &hi)
+{
+	vec t0 = _mm256_unpacklo_epi8(a, b);
+	vec t1 = _mm256_unpackhi_epi8(a, b);
+	lo = _mm256_permute2x128_si256(t0, t1, 0x20);
+	hi = _mm256_permute2x128_si256(t0, t1, 0x31);
+}
+static inline void v_zip16(vec a, vec b, vec &lo, vec &hi)
+{
+	vec t0 = _mm256_unpacklo_epi16(a, b);
+	vec t1 = _mm256_unpackhi_epi16(a, b);
+	lo = _mm256_permute2x128_si256(t0, t1, 0x20);
+	hi = _mm256_permute2x128_si256(t0, t1, 0x31);
+}
+
+#elif PS3EYE_SIMD_SSE2
+
+typedef __m128i vec;
+
+static inline vec v_load(const void *p) { return _mm_loadu_si128((const __m128i*)p); }
+static inline void v_store(void *p, vec a) { _mm_storeu_si128((__m128i*)p, a); }
+static inline vec v_zero() { return _mm_setzero_si128(); }
+static inline vec v_set8(uint8_t v) { return _mm_set1_epi8((char)v); }
+static inline vec v_set16(int16_t v) { return _mm_set1_epi16(v); }
+
+static inline vec v_and(vec a, vec b) { return _mm_and_si128(a, b); }
+static inline vec v_or(vec a, vec b) { return _mm_or_si128(a, b); }
+static inline vec v_xor(vec a, vec b) { return _mm_xor_si128(a, b); }
+static inline vec v_andnot(vec a, vec b) { return _mm_andnot_si128(b, a); } // a & ~b
+
+static inline vec v_avg8(vec a, vec b) { return _mm_avg_epu8(a, b); }
+static inline vec v_min8(vec a, vec b) { return _mm_min_epu8(a, b); }
+static inline vec v_max8(vec a, vec b) { return _mm_max_epu8(a, b); }
+static inline vec v_adds8(vec a, vec b) { return _mm_adds_epu8(a, b); }
+static inline vec v_subs8(vec a, vec b) { return _mm_subs_epu8(a, b); }
+static inline vec v_eq8(vec a, vec b) { return _mm_cmpeq_epi8(a, b); }
+static inline uint32_t v_movemask8(vec a) { return (uint32_t)_mm_movemask_epi8(a); }
+
+static inline vec v_add16(vec a, vec b) { return _mm_add_epi16(a, b); }
+static inline vec v_adds16(vec a, vec b) { return _mm_adds_epi16(a, b); }
+static inline vec v_sub16(vec a, vec b) { return _mm_sub_epi16(a, b); }
+static inline vec v_mullo16(vec a, vec b) { return _mm_mullo_epi16(a, b); }
+static inline vec v_mulhi16(vec a, vec b) { return _mm_mulhi_epi16(a, b); }
+static inline vec v_min16(vec a, vec b) { return _mm_min_epi16(a, b); }
+static inline vec v_max16(vec a, vec b) { return _mm_max_epi16(a, b); }
+static inline vec v_gt16(vec a, vec b) { return _mm_cmpgt_epi16(a, b); }
+#define v_srli16(a, n) _mm_srli_epi16(a, n)
+#define v_srai16(a, n) _mm_srai_epi16(a, n)
+#define v_slli16(a, n) _mm_slli_epi16(a, n)
+
+static inline vec v_widen_lo(vec a) { return _mm_unpacklo_epi8(a, _mm_setzero_si128()); }
+static inline vec v_widen_hi(vec a) { return _mm_unpackhi_epi8(a, _mm_setzero_si128()); }
+static inline vec v_pack16(vec lo, vec hi) { return _mm_packus_epi16(lo, hi); }
+static inline void v_zip8(vec a, vec b, vec &lo, vec &hi)
+{
+	lo = _mm_unpacklo_epi8(a, b);
+	hi = _mm_unpackhi_epi8(a, b);
+}
+static inline void v_zip16(vec a, vec b, vec &lo, vec &hi)
+{
+	lo = _mm_unpacklo_epi16(a, b);
+	hi = _mm_unpackhi_epi16(a, b);
+}
+
+#elif PS3EYE_SIMD_NEON
+
+typedef uint8x16_t vec;
+
+static inline vec v_load(const void *p) { return vld1q_u8((const uint8_t*)p); }
+static inline void v_store(void *p, vec a) { vst1q_u8((uint8_t*)p, a); }
+static inline vec v_zero() { return vdupq_n_u8(0); }
+static inline vec v_set8(uint8_t v) { return vdupq_n_u8(v); }
+static inline vec v_set16(int16_t v) { return vreinterpretq_u8_s16(vdupq_n_s16(v)); }
+
+static inline vec v_and(vec a, vec b) { return vandq_u8(a, b); }
+static inline vec v_or(vec a, vec b) { return vorrq_u8(a, b); }
+static inline vec v_xor(vec a, vec b) { return veorq_u8(a, b); }
+static inline vec v_andnot(vec a, vec b) { return vbicq_u8(a, b); } // a & ~b
+
+static inline vec v_avg8(vec a, vec b) { return vrhaddq_u8(a, b); }
+static inline vec v_min8(vec a, vec b) { return vminq_u8(a, b); }
+static inline vec v_max8(vec a, vec b) { return vmaxq_u8(a, b); }
+static inline vec v_adds8(vec a, vec b) { return vqaddq_u8(a, b); }
+static inline vec v_subs8(vec a, vec b) { return vqsubq_u8(a, b); }
+static inline vec v_eq8(vec a, vec b) { return vceqq_u8(a, b); }
+static inline uint32_t v_movemask8(vec a)
+{
+	static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t m = vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(a), 7));
+	m = vandq_u8(m, vld1q_u8(bits));
+	uint8x8_t lo = vget_low_u8(m), hi = vget_high_u8(m);
+	lo = vpadd_u8(lo, lo); lo = vpadd_u8(lo, lo); lo = vpadd_u8(lo, lo);
+	hi = vpadd_u8(hi, hi); hi = vpadd_u8(hi, hi); hi = vpadd_u8(hi, hi);
+	return (uint32_t)vget_lane_u8(lo, 0) | ((uint32_t)vget_lane_u8(hi, 0) << 8);
+}
+
+#define V_S16(a) vreinterpretq_s16_u8(a)
+#define V_U8(a) vreinterpretq_u8_s16(a)
+static inline vec v_add16(vec a, vec b) { return V_U8(vaddq_s16(V_S16(a), V_S16(b))); }
+static inline vec v_adds16(vec a, vec b) { return V_U8(vqaddq_s16(V_S16(a), V_S16(b))); }
+static inline vec v_sub16(vec a, vec b) { return V_U8(vsubq_s16(V_S16(a), V_S16(b))); }
+static inline vec v_mullo16(vec a, vec b) { return V_U8(vmulq_s16(V_S16(a), V_S16(b))); }
+static inline vec v_mulhi16(vec a, vec b)
+{
+	int32x4_t lo = vmull_s16(vget_low_s16(V_S16(a)), vget_low_s16(V_S16(b)));
+	int32x4_t hi = vmull_s16(vget_high_s16(V_S16(a)), vget_high_s16(V_S16(b)));
+	return V_U8(vcombine_s16(vshrn_n_s32(lo, 16), vshrn_n_s32(hi, 16)));
+}
+static inline vec v_min16(vec a, vec b) { return V_U8(vminq_s16(V_S16(a), V_S16(b))); }
+static inline vec v_max16(vec a, vec b) { return V_U8(vmaxq_s16(V_S16(a), V_S16(b))); }
+static inline vec v_gt16(vec a, vec b) { return vreinterpretq_u8_u16(vcgtq_s16(V_S16(a), V_S16(b))); }
+#define v_srli16(a, n) vreinterpretq_u8_u16(vshrq_n_u16(vreinterpretq_u16_u8(a), n))
+#define v_srai16(a, n) V_U8(vshrq_n_s16(V_S16(a), n))
+#define v_slli16(a, n) V_U8(vshlq_n_s16(V_S16(a), n))
+
+static inline vec v_widen_lo(vec a) { return vreinterpretq_u8_u16(vmovl_u8(vget_low_u8(a))); }
+static inline vec v_widen_hi(vec a) { return vreinterpretq_u8_u16(vmovl_u8(vget_high_u8(a))); }
+static inline vec v_pack16(vec lo, vec hi) { return vcombine_u8(vqmovun_s16(V_S16(lo)), vqmovun_s16(V_S16(hi))); }
+static inline void v_zip8(vec a, vec b, vec &lo, vec &hi)
+{
+	uint8x16x2_t z = vzipq_u8(a, b);
+	lo = z.val[0];
+	hi = z.val[1];
+}
+static inline void v_zip16(vec a, vec b, vec &lo, vec &hi)
+{
+	uint16x8x2_t z = vzipq_u16(vreinterpretq_u16_u8(a), vreinterpretq_u16_u8(b));
+	lo = vreinterpretq_u8_u16(z.val[0]);
+	hi = vreinterpretq_u8_u16(z.val[1]);
+}
+
+#endif
+
+#if PS3EYE_SIMD
+// shared helpers built on the primitives above
+static inline vec v_absdiff8(vec a, vec b) { return v_or(v_subs8(a, b), v_subs8(b, a)); }
+// 0xff where a > b (unsigned)
+static inline vec v_gt8(vec a, vec b) { return v_xor(v_eq8(v_subs8(a, b), v_zero()), v_set8(0xff)); }
+// pick a where mask is set, b elsewhere
+static inline vec v_select(vec mask, vec a, vec b) { return v_or(v_and(mask, a), v_andnot(b, mask)); }
+static inline vec v_abs16(vec a) { return v_max16(a, v_sub16(v_zero(), a)); }
+#endif
+
+} // namespace
+
+#endif
@@ -0,0 +1,181 @@
+#include "ps3eye_stack.h"
+#include "ps3eye_simd.h"
+#include "ps3eye_parallel.h"
+
+#include <cmath>
+
+namespace ps3eye {
+
+FrameStack::FrameStack()
+{
+	mode = STACK_MEAN;
+	sigmas = 3.0f;
+	frames = added = 0;
+	clipping = complete = false;
+	row_bytes = num_rows = 0;
+	next_seq = 0;
+	has_seq = false;
+}
+
+bool FrameStack::begin(uint32_t n, StackMode m, float k)
+{
+	if (n == 0 || n > (m == STACK_SIGMA_CLIP ? 255u : 257u) || !(k > 0))
+		return false;
+	mode = m;
+	sigmas = k;
+	frames = n;
+	added = 0;
+	clipping = complete = false;
+	row_bytes = num_rows = 0;
+	count.clear();
+	has_seq = false;
+	return true;
+}
+
+void FrameStack::add_rows(const uint8_t *src, int stride, int begin, int end)
+{
+	for (int y = begin; y < end; y++) {
+		const uint8_t *row = src + y * stride;
+		uint16_t *s = &sum[y * row_bytes];
+		uint32_t x = 0;
+
+#if PS3EYE_SIMD
+		for (; x + PS3EYE_SIMD_WIDTH <= row_bytes; x += PS3EYE_SIMD_WIDTH) {
+			vec a = v_load(row + x);
+			uint16_t *sp = s + x;
+			v_store(sp, v_add16(v_load(sp), v_widen_lo(a)));
+			v_store(sp + PS3EYE_SIMD_WIDTH / 2, v_add16(v_load(sp + PS3EYE_SIMD_WIDTH / 2), v_widen_hi(a)));
+		}
+#endif
+		for (; x < row_bytes; x++) s[x] += row[x];
+
+		if (mode == STACK_SIGMA_CLIP) {
+			uint32_t *sq = &sum_sq[y * row_bytes];
+			for (x = 0; x < row_bytes; x++) sq[x] += row[x] * row[x];
+		}
+	}
+}
+
+void FrameStack::clip_rows(const uint8_t *src, int stride, int begin, int end)
+{
+	for (int y = begin; y < end; y++) {
+		const uint8_t *row = src + y * stride;
+		size_t i = y * row_bytes;
+		uint16_t *s = &sum[i];
+		uint8_t *c = &count[i];
+		const uint8_t *l = &lo[i], *h = &hi[i];
+		uint32_t x = 0;
+
+#if PS3EYE_SIMD
+		const vec one = v_set8(1);
+		for (; x + PS3EYE_SIMD_WIDTH <= row_bytes; x += PS3EYE_SIMD_WIDTH) {
+			vec a = v_load(row + x);
+			vec keep = v_and(v_eq8(v_max8(a, v_load(l + x)), a), v_eq8(v_min8(a, v_load(h + x)), a));
+			a = v_and(a, keep);
+			v_store(c + x, v_adds8(v_load(c + x), v_and(keep, one)));
+			uint16_t *sp = s + x;
+			v_store(sp, v_add16(v_load(sp), v_widen_lo(a)));
+			v_store(sp + PS3EYE_SIMD_WIDTH / 2, v_add16(v_load(sp + PS3EYE_SIMD_WIDTH / 2), v_widen_hi(a)));
+		}
+#endif
+		for (; x < row_bytes; x++) {
+			if (row[x] < l[x] || row[x] > h[x]) continue;
+			s[x] += row[x];
+			c[x]++;
+		}
+	}
+}
+
+// reference mean and deviation of the first pass to bounds, mean kept for
+// samples that end up with none
+void FrameStack::set_bounds()
+{
+	size_t n = (size_t)row_bytes * num_rows;
+	lo.resize(n);
+	hi.resize(n);
+	frame.resize(n);
+
+	parallel_rows(num_rows, 16, [&](int begin, int end) {
+		float inv = 1.0f / frames;
+		for (size_t i = (size_t)begin * row_bytes; i < (size_t)end * row_bytes; i++) {
+			float m = sum[i] * inv;
+			float var = sum_sq[i] * inv - m * m;
+			// a steady sample still needs room for a level of quantization
+			float d = sigmas * (var > 0.25f ? sqrtf(var) : 0.5f);
+			float l = floorf(m - d), h = ceilf(m + d);
+			lo[i] = (uint8_t)(l < 0 ? 0 : l);
+			hi[i] = (uint8_t)(h > 255 ? 255 : h);
+			frame[i] = (uint8_t)(m + 0.5f);
+		}
+	});
+
+	sum.assign(n, 0);
+	count.assign(n, 0);
+}
+
+void FrameStack::finish()
+{
+	frame.resize((size_t)row_bytes * num_rows);
+	parallel_rows(num_rows, 16, [&](int begin, int end) {
+		for (size_t i = (size_t)begin * row_bytes; i < (size_t)end * row_bytes; i++) {
+			uint32_t c = clipping ? count[i] : frames;
+			if (c) frame[i] = (uint8_t)((sum[i] + c / 2) / c);
+		}
+	});
+	complete = true;
+}
+
+bool FrameStack::add(const uint8_t *src, int stride, uint32_t rowBytes, uint32_t rows)
+{
+	if (complete || frames == 0 || rowBytes == 0 || rows == 0)
+		return false;
+
+	if (row_bytes == 0) {
+		row_bytes = rowBytes;
+		num_rows = rows;
+		sum.assign((size_t)rowBytes * rows, 0);
+		if (mode == STACK_SIGMA_CLIP) sum_sq.assign((size_t)rowBytes * rows, 0);
+	} else if (rowBytes != row_bytes || rows != num_rows) {
+		return false;
+	}
+
+	parallel_rows(rows, 32, [&](int begin, int end) {
+		if (clipping) clip_rows(src, stride, begin, end);
+		else add_rows(src, stride, begin, end);
+	});
+	added++;
+
+	if (added == frames && mode == STACK_SIGMA_CLIP) {
+		set_bounds();
+		clipping = true;
+	} else if (added == (clipping ? 2 : 1) * frames) {
+		finish();
+		return true;
+	}
+	return false;
+}
+
+bool FrameStack::update(const PS3EYECam &cam)
+{
+	uint32_t n = cam.getFrameCount();
+	if (n == 0) return false;
+	if (!has_seq) {
+		next_seq = n - 1;
+		has_seq = true;
+	}
+	// the ring holds the last 15 frames, a restarted stream counts from 0
+	int32_t behind = (int32_t)(n - next_seq);
+	if (behind < 0) next_seq = n - 1;
+	else if (behind > 15) next_seq = n - 15;
+
+	bool yuyv = cam.getFormat() == FORMAT_YUYV;
+	uint32_t rb = cam.getWidth() * (yuyv ? 2 : 1);
+	bool done = false;
+	for (; !complete && (int32_t)(n - next_seq) > 0; next_seq++) {
+		const uint8_t *f = cam.getFramePointer(next_seq);
+		if (f != NULL && add(f, rb, rb, cam.getHeight())) done = true;
+	}
+	return done;
+}
+
+} // namespace
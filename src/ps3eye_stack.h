@@ -0,0 +1,79 @@
+#ifndef PS3EYE_STACK_H
+#define PS3EYE_STACK_H
+
+#include "ps3eye.h"
+
+#include <vector>
+
+namespace ps3eye {
+
+enum StackMode
+{
+	STACK_MEAN = 0,		// mean of the frames
+	STACK_SIGMA_CLIP	// mean of the samples within k sigma of a reference
+						// stack, takes twice the frames
+};
+
+/* Averages consecutive frames into a low noise still without keeping
+ * them: every frame is added to 16 bit sums as it arrives, so the cost
+ * per frame is one widening add pass.
+ *
+ * Sigma clipping first stacks the frames as in STACK_MEAN, also summing
+ * squares, and turns mean and deviation into per sample bounds. The same
+ * number of frames again is then summed with samples outside the bounds
+ * left out, which drops hot pixel flicker, cosmic hits and passing
+ * objects. Samples left out in every frame keep the reference mean.
+ *
+ * Samples are bytes, so YUYV, Y8 and raw Bayer frames all work. */
+class FrameStack
+{
+public:
+	FrameStack();
+
+	// start a stack of `frames` frames, up to 257 (255 when clipping)
+	bool begin(uint32_t frames, StackMode mode = STACK_MEAN, float sigmas = 3.0f);
+	// add a frame of rows x rowBytes bytes, true when this completed the stack.
+	// The first frame sets the size, later ones must match.
+	bool add(const uint8_t *frame, int stride, uint32_t rowBytes, uint32_t rows);
+	// add the camera's frames since the last call, in order, true when this
+	// completed the stack. Frames already gone from the ring are skipped.
+	bool update(const PS3EYECam &cam);
+
+	bool isComplete() const { return complete; }
+	// frames added so far, across both passes when clipping
+	uint32_t getAdded() const { return added; }
+
+	uint32_t getRowBytes() const { return row_bytes; }
+	uint32_t getRows() const { return num_rows; }
+	// the stacked frame once complete, rows x rowBytes bytes
+	const uint8_t* getFrame() const { return complete ? &frame[0] : NULL; }
+	// per sample sums of the (last) pass for more than 8 bits, and when
+	// clipping how many samples were kept
+	const uint16_t* getSums() const { return sum.empty() ? NULL : &sum[0]; }
+	const uint8_t* getCounts() const { return count.empty() ? NULL : &count[0]; }
+
+private:
+	void add_rows(const uint8_t *src, int stride, int begin, int end);
+	void clip_rows(const uint8_t *src, int stride, int begin, int end);
+	void set_bounds();
+	void finish();
+
+	StackMode mode;
+	float sigmas;
+	uint32_t frames, added;
+	bool clipping;		// second pass of STACK_SIGMA_CLIP
+	bool complete;
+
+	uint32_t row_bytes, num_rows;
+	std::vector<uint16_t> sum;
+	std::vector<uint32_t> sum_sq;
+	std::vector<uint8_t> lo, hi, count;
+	std::vector<uint8_t> frame;
+
+	uint32_t next_seq;
+	bool has_seq;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,234 @@
+#include "ps3eye_undistort.h"
+#include "ps3eye_simd.h"
+#include "ps3eye_parallel.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace ps3eye {
+
+#define TILE_W			32
+#define TILE_H			16
+#define COORD_SHIFT		5
+#define COORD_ONE		(1 << COORD_SHIFT)
+#define OUTSIDE			(-32768)	// source outside the frame
+#define HEADER_SIZE		64
+#define FILE_VERSION	1
+
+static const char file_magic[4] = { 'P', '3', 'U', 'D' };
+
+Undistort::Undistort()
+{
+	memset(&lens, 0, sizeof(lens));
+	width = height = 0;
+	tiles_x = tiles_y = 0;
+	table = NULL;
+}
+
+bool Undistort::setLens(const LensModel &l, uint32_t w, uint32_t h, const char *cachePath)
+{
+	table = NULL;
+	table_buf.clear();
+	file.close();
+	if (w < 2 || h < 2 || w > 1024 || h > 1024 || !(l.fx > 0) || !(l.fy > 0))
+		return false;
+
+	lens = l;
+	width = w;
+	height = h;
+	tiles_x = (w + TILE_W - 1) / TILE_W;
+	tiles_y = (h + TILE_H - 1) / TILE_H;
+	newest.reset();
+
+	if (cachePath && load_cache(cachePath))
+		return true;
+	build();
+	if (cachePath && !save_cache(cachePath)) {
+		debug("undistort: can't write %s\n", cachePath);
+	}
+	return true;
+}
+
+/* Output pixel to distorted source position, clamped so the 2x2
+ * neighbourhood stays inside; positions more than half a pixel out are
+ * marked as outside. */
+void Undistort::build()
+{
+	table_buf.assign((size_t)tiles_x * tiles_y * TILE_W * TILE_H * 2, OUTSIDE);
+	const LensModel L = lens;
+	const int max_x = (width - 1) * COORD_ONE - 1, max_y = (height - 1) * COORD_ONE - 1;
+
+	parallel_rows(height, 16, [&](int begin, int end) {
+		for (int y = begin; y < end; y++) {
+			double yn = (y - L.cy) / L.fy;
+			for (uint32_t x = 0; x < width; x++) {
+				double xn = (x - L.cx) / L.fx;
+				double r2 = xn * xn + yn * yn;
+				double radial = 1 + r2 * (L.k1 + r2 * (L.k2 + r2 * L.k3));
+				double xd = xn * radial + 2 * L.p1 * xn * yn + L.p2 * (r2 + 2 * xn * xn);
+				double yd = yn * radial + L.p1 * (r2 + 2 * yn * yn) + 2 * L.p2 * xn * yn;
+				double sx = L.fx * xd + L.cx, sy = L.fy * yd + L.cy;
+
+				// tile row: TILE_W x positions, then TILE_W y positions
+				size_t i = (((size_t)(y / TILE_H) * tiles_x + x / TILE_W) * TILE_H + y % TILE_H) * TILE_W * 2 + x % TILE_W;
+				if (!(sx >= -0.5 && sx <= width - 0.5 && sy >= -0.5 && sy <= height - 0.5))
+					continue;
+				int ix = (int)(sx * COORD_ONE + 0.5), iy = (int)(sy * COORD_ONE + 0.5);
+				table_buf[i] = (int16_t)(ix < 0 ? 0 : (ix > max_x ? max_x : ix));
+				table_buf[i + TILE_W] = (int16_t)(iy < 0 ? 0 : (iy > max_y ? max_y : iy));
+			}
+		}
+	});
+	table = &table_buf[0];
+}
+
+bool Undistort::load_cache(const char *path)
+{
+	if (!file.open(path)) return false;
+
+	const uint8_t *base = file.data();
+	size_t entries = (size_t)tiles_x * tiles_y * TILE_W * TILE_H;
+	uint16_t version = 0;
+	uint32_t w = 0, h = 0;
+	if (file.size() >= HEADER_SIZE) {
+		memcpy(&version, base + 4, 2);
+		memcpy(&w, base + 8, 4);
+		memcpy(&h, base + 12, 4);
+	}
+	if (file.size() != HEADER_SIZE + entries * 2 * sizeof(int16_t) ||
+		memcmp(base, file_magic, 4) != 0 || version != FILE_VERSION ||
+		base[6] != TILE_W || base[7] != TILE_H || w != width || h != height ||
+		memcmp(base + 16, &lens, sizeof(lens)) != 0) {
+		file.close();
+		return false;
+	}
+	table = (const int16_t*)(base + HEADER_SIZE);
+	return true;
+}
+
+bool Undistort::save_cache(const char *path) const
+{
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) return false;
+
+	uint8_t header[HEADER_SIZE] = { 0 };
+	uint16_t version = FILE_VERSION;
+	memcpy(header, file_magic, 4);
+	memcpy(header + 4, &version, 2);
+	header[6] = TILE_W;
+	header[7] = TILE_H;
+	memcpy(header + 8, &width, 4);
+	memcpy(header + 12, &height, 4);
+	memcpy(header + 16, &lens, sizeof(lens));
+
+	bool ok = fwrite(header, HEADER_SIZE, 1, f) == 1 &&
+			  fwrite(table, sizeof(int16_t), table_buf.size(), f) == table_buf.size();
+	return fclose(f) == 0 && ok;
+}
+
+// top = a + (b - a) wx, bottom likewise, then top + (bottom - top) wy,
+// with 5 bit weights; the vertical step is a mulhi so nothing overflows
+static inline uint8_t bilinear(int ab, int cd, int wx, int wy)
+{
+	int a = ab & 0xff, c = cd & 0xff;
+	int top = (a << COORD_SHIFT) + ((ab >> 8) - a) * wx;
+	int bot = (c << COORD_SHIFT) + ((cd >> 8) - c) * wx;
+	int v = ((int16_t)((bot - top) << 2) * (wy << 9)) >> 16;
+	return (uint8_t)((top + v + COORD_ONE / 2) >> COORD_SHIFT);
+}
+
+void Undistort::remap_tiles(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+							bool yuyv, int begin, int end) const
+{
+	const int step = yuyv ? 2 : 1;
+	// horizontal neighbour pairs of the top and bottom row, left one low
+	uint16_t ab[TILE_W], cd[TILE_W];
+	uint8_t out[TILE_W], chroma[TILE_W];
+
+	for (int ty = begin; ty < end; ty++) {
+		for (uint32_t tx = 0; tx < tiles_x; tx++) {
+			const uint32_t x0 = tx * TILE_W, n = (std::min)((uint32_t)TILE_W, width - x0);
+			const int16_t *tile = table + ((size_t)ty * tiles_x + tx) * TILE_W * TILE_H * 2;
+
+			for (uint32_t r = 0; r < TILE_H; r++) {
+				const uint32_t y = ty * TILE_H + r;
+				if (y >= height) break;
+				const int16_t *xs = tile + r * TILE_W * 2, *ys = xs + TILE_W;
+
+				for (uint32_t i = 0; i < n; i++) {
+					int sx = xs[i], sy = ys[i];
+					if (sx == OUTSIDE) {
+						// black, and the weights of OUTSIDE are 0
+						ab[i] = cd[i] = 0;
+						chroma[i] = 128;
+						continue;
+					}
+					const uint8_t *p = src + (sy >> COORD_SHIFT) * src_stride + (sx >> COORD_SHIFT) * step;
+					ab[i] = (uint16_t)(p[0] | p[step] << 8);
+					cd[i] = (uint16_t)(p[src_stride] | p[src_stride + step] << 8);
+					if (yuyv) {
+						// nearest macropixel, U for even output pixels and V for odd ones
+						int nx = (sx + COORD_ONE / 2) >> COORD_SHIFT, ny = (sy + COORD_ONE / 2) >> COORD_SHIFT;
+						chroma[i] = src[ny * src_stride + (nx & ~1) * 2 + ((x0 + i) & 1 ? 3 : 1)];
+					}
+				}
+
+				uint32_t i = 0;
+#if PS3EYE_SIMD
+				const vec lo8 = v_set16(0xff), frac = v_set16(COORD_ONE - 1), round = v_set16(COORD_ONE / 2);
+				for (; i + PS3EYE_SIMD_WIDTH <= n; i += PS3EYE_SIMD_WIDTH) {
+					vec res[2];
+					for (int half = 0; half < 2; half++) {
+						uint32_t j = i + half * (PS3EYE_SIMD_WIDTH / 2);
+						vec vab = v_load(ab + j), vcd = v_load(cd + j);
+						vec wx = v_and(v_load(xs + j), frac), wy = v_and(v_load(ys + j), frac);
+						vec a16 = v_and(vab, lo8), c16 = v_and(vcd, lo8);
+						vec top = v_add16(v_slli16(a16, COORD_SHIFT), v_mullo16(v_sub16(v_srli16(vab, 8), a16), wx));
+						vec bot = v_add16(v_slli16(c16, COORD_SHIFT), v_mullo16(v_sub16(v_srli16(vcd, 8), c16), wx));
+						vec v = v_mulhi16(v_slli16(v_sub16(bot, top), 2), v_slli16(wy, 9));
+						res[half] = v_srai16(v_add16(v_add16(top, v), round), COORD_SHIFT);
+					}
+					v_store(out + i, v_pack16(res[0], res[1]));
+				}
+#endif
+				for (; i < n; i++)
+					out[i] = bilinear(ab[i], cd[i], xs[i] & (COORD_ONE - 1), ys[i] & (COORD_ONE - 1));
+
+				uint8_t *row = dst + y * dst_stride + x0 * step;
+				if (yuyv) {
+					for (i = 0; i < n; i++) {
+						row[2 * i] = out[i];
+						row[2 * i + 1] = chroma[i];
+					}
+				} else {
+					memcpy(row, out, n);
+				}
+			}
+		}
+	}
+}
+
+void Undistort::apply(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride,
+					  PixelInput input) const
+{
+	if (!isValid()) return;
+	parallel_rows(tiles_y, 1, [&](int begin, int end) {
+		remap_tiles(src, srcStride, dst, dstStride, input == INPUT_YUYV, begin, end);
+	});
+}
+
+bool Undistort::update(const PS3EYECam &cam)
+{
+	if (!isValid() || cam.getWidth() != width || cam.getHeight() != height || cam.getFormat() != FORMAT_YUYV)
+		return false;
+
+	const uint8_t *src = newest.next(cam);
+	if (src == NULL) return false;
+
+	frame.resize((size_t)width * 2 * height);
+	apply(src, width * 2, &frame[0], width * 2, INPUT_YUYV);
+	return true;
+}
+
+} // namespace
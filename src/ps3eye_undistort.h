@@ -0,0 +1,80 @@
+#ifndef PS3EYE_UNDISTORT_H
+#define PS3EYE_UNDISTORT_H
+
+#include "ps3eye_input.h"
+#include "ps3eye_mapfile.h"
+
+#include <vector>
+
+namespace ps3eye {
+
+// pinhole intrinsics in pixels and the radial (k1, k2, k3) and tangential
+// (p1, p2) distortion of the usual Brown-Conrady model, as calibrated
+// for example by OpenCV
+struct LensModel
+{
+	float fx, fy, cx, cy;
+	float k1, k2, p1, p2, k3;
+};
+
+/* Lens undistortion by a precomputed remap table. For every output pixel
+ * the table holds the distorted source position with 5 fractional bits,
+ * stored tile by tile (32x16) so a tile reads a compact part of both the
+ * table and the source. Each tile row gathers the four neighbours of its
+ * pixels and interpolates them with SIMD; tile rows are split over the
+ * worker threads. The output keeps the intrinsics of the input; the
+ * chroma of YUYV frames comes from the nearest macropixel.
+ *
+ * Building a VGA table takes a few milliseconds of floating point work;
+ * with a cache path it is mapped from disk instead when the lens and
+ * size match. Raw Bayer frames need demosaicing first. */
+class Undistort
+{
+public:
+	Undistort();
+
+	// build or map the table for width x height frames; a cache that does
+	// not match is rebuilt and written again
+	bool setLens(const LensModel &lens, uint32_t width, uint32_t height, const char *cachePath = NULL);
+	bool isValid() const { return table != NULL; }
+	uint32_t getWidth() const { return width; }
+	uint32_t getHeight() const { return height; }
+
+	// undistort a frame of the table's size into dst, not in place
+	void apply(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride,
+			   PixelInput input = INPUT_YUYV) const;
+	// undistort the newest frame of the camera if it was not done yet.
+	// False if there was none, the camera's frame size is not the table's
+	// or its format is not FORMAT_YUYV: the ring only holds YUYV or raw
+	// Bayer frames, and Bayer needs demosaicing first. Y8 images from
+	// elsewhere go through apply() with INPUT_GRAY.
+	bool update(const PS3EYECam &cam);
+	// sequence of the frame last done by update()
+	uint32_t getSequence() const { return newest.getSequence(); }
+	// result of update(), width x height in the input format
+	const uint8_t* getFrame() const { return frame.empty() ? NULL : &frame[0]; }
+
+private:
+	Undistort(const Undistort&);
+	void operator=(const Undistort&);
+
+	void build();
+	bool load_cache(const char *path);
+	bool save_cache(const char *path) const;
+	void remap_tiles(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+					 bool yuyv, int begin, int end) const;
+
+	LensModel lens;
+	uint32_t width, height;
+	uint32_t tiles_x, tiles_y;
+	const int16_t *table;	// x, y pairs, into table_buf or the mapping
+	std::vector<int16_t> table_buf;
+	MappedFile file;
+
+	std::vector<uint8_t> frame;
+	NewestFrame newest;
+};
+
+} // namespace
+
+#endif